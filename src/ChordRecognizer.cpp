@@ -0,0 +1,173 @@
+#include "Skylander.hpp"
+#include "Core.hpp"
+
+#include <climits>
+
+struct ChordRecognizer : Module {
+	enum ParamIds {
+		NUM_PARAMS
+	};
+	enum InputIds {
+		VOCT_INPUT,
+		GATE_INPUT,
+		NUM_INPUTS
+	};
+	enum OutputIds {
+		ROOT_OUTPUT,
+		BASS_OUTPUT,
+		CHORD_OUTPUT,
+		INVERSION_OUTPUT,
+		VALID_OUTPUT,
+		CHANGED_OUTPUT,
+		NUM_OUTPUTS
+	};
+	enum LightIds {
+		NUM_LIGHTS
+	};
+
+	Core core;
+
+	// Held notes as pitch classes, the chord is only looked up again when these change
+	int mask = -1;
+	int bassNote = INT_MIN;
+
+	// Written by the engine, read by the display
+	int chord = 0;
+	int root = 0;
+	int inversion = 0;
+	int bass = 0;
+
+	SkylanderPulseGenerator changedPulse;
+
+	ChordRecognizer() {
+		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
+		configInput(VOCT_INPUT, "V/OCT");
+		configInput(GATE_INPUT, "Gate, all notes are held when not patched");
+		configOutput(ROOT_OUTPUT, "Chord root");
+		configOutput(BASS_OUTPUT, "Bass note V/OCT");
+		configOutput(CHORD_OUTPUT, "Chord, 0.1V per chord");
+		configOutput(INVERSION_OUTPUT, "Inversion, 1V per step");
+		configOutput(VALID_OUTPUT, "Chord recognized gate");
+		configOutput(CHANGED_OUTPUT, "Chord changed trigger");
+	}
+
+	void onReset() override {
+		mask = -1;
+		bassNote = INT_MIN;
+	}
+
+	void recognize(int newMask, int newBassNote) {
+		mask = newMask;
+		bassNote = newBassNote;
+		bass = ((newBassNote % 12) + 12) % 12;
+		chord = core.getChordFromMask(mask, bass, &root, &inversion);
+		changedPulse.trigger(Core::TRIGGER);
+	}
+
+	void process(const ProcessArgs& args) override {
+		int channels = inputs[VOCT_INPUT].getChannels();
+		bool gated = inputs[GATE_INPUT].isConnected();
+
+		int newMask = 0;
+		int newBassNote = INT_MAX;
+		for (int c = 0; c < channels; c++) {
+			if (gated && inputs[GATE_INPUT].getPolyVoltage(c) < 1.f) {
+				continue;
+			}
+			int note = (int) std::round(inputs[VOCT_INPUT].getVoltage(c) * 12.f);
+			newMask |= 1 << (((note % 12) + 12) % 12);
+			newBassNote = std::min(newBassNote, note);
+		}
+		if (newMask == 0) {
+			newBassNote = 0;
+		}
+
+		if (newMask != mask || newBassNote != bassNote) {
+			recognize(newMask, newBassNote);
+		}
+
+		outputs[ROOT_OUTPUT].setVoltage(root * Core::SEMITONE);
+		outputs[BASS_OUTPUT].setVoltage(bassNote * Core::SEMITONE);
+		outputs[CHORD_OUTPUT].setVoltage(chord * 0.1f);
+		outputs[INVERSION_OUTPUT].setVoltage((float) inversion);
+		outputs[VALID_OUTPUT].setVoltage(chord ? 10.f : 0.f);
+		outputs[CHANGED_OUTPUT].setVoltage(changedPulse.process(args.sampleTime) ? 10.f : 0.f);
+	}
+};
+
+struct ChordDisplayWidget : TransparentWidget {
+	ChordRecognizer *module = NULL;
+	std::string _fontPath;
+
+	ChordDisplayWidget() :
+		_fontPath(asset::system("res/fonts/ShareTechMono-Regular.ttf"))
+	{
+	};
+
+	std::string getChordName() {
+		if (!module || module->mask <= 0) {
+			return "-";
+		}
+		if (module->chord == 0) {
+			return "?";
+		}
+		std::string s(Core::noteNames[module->root]);
+		s += std::string(Core::ChordTable[module->chord].quality);
+		if (module->inversion < 3) {
+			s += std::string(Core::inversionNames[module->inversion]);
+		} else {
+			s += "/" + std::string(Core::noteNames[module->bass]);
+		}
+		return s;
+	}
+
+	void draw(const DrawArgs& args) override {
+		std::shared_ptr<Font> font = APP->window->loadFont(_fontPath);
+		if (!font) {
+			return;
+		}
+
+		nvgBeginPath(args.vg);
+		nvgRoundedRect(args.vg, 0.0, 0.0, box.size.x, box.size.y, 2.0);
+		nvgFillColor(args.vg, nvgRGB(0x20, 0x10, 0x10));
+		nvgFill(args.vg);
+		nvgStrokeWidth(args.vg, 1.0);
+		nvgStrokeColor(args.vg, nvgRGB(0x10, 0x10, 0x10));
+		nvgStroke(args.vg);
+
+		nvgFontSize(args.vg, 13);
+		nvgFontFaceId(args.vg, font->handle);
+		nvgTextAlign(args.vg, NVG_ALIGN_CENTER | NVG_ALIGN_MIDDLE);
+		nvgFillColor(args.vg, nvgRGB(0xff, 0xd5, 0xd5));
+		nvgText(args.vg, box.size.x / 2, box.size.y / 2, getChordName().c_str(), NULL);
+	}
+};
+
+struct ChordRecognizerWidget : ModuleWidget {
+  ChordRecognizerWidget(ChordRecognizer* module) {
+    setModule(module);
+    setPanel(APP->window->loadSvg(asset::plugin(pluginInstance, "res/ChordRecognizer.svg")));
+
+    addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, 0)));
+    addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, 0)));
+    addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+    addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+
+    ChordDisplayWidget *display = createWidget<ChordDisplayWidget>(mm2px(Vec(2.0, 16.0)));
+    display->box.size = mm2px(Vec(26.48, 10.0));
+    display->module = module;
+    addChild(display);
+
+    addInput(createInputCentered<PJ301MPort>(mm2px(Vec(7.62, 40.0)), module, ChordRecognizer::VOCT_INPUT));
+    addInput(createInputCentered<PJ301MPort>(mm2px(Vec(22.86, 40.0)), module, ChordRecognizer::GATE_INPUT));
+
+    addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(7.62, 86.0)), module, ChordRecognizer::ROOT_OUTPUT));
+    addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(22.86, 86.0)), module, ChordRecognizer::BASS_OUTPUT));
+    addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(7.62, 97.0)), module, ChordRecognizer::CHORD_OUTPUT));
+    addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(22.86, 97.0)), module, ChordRecognizer::INVERSION_OUTPUT));
+    addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(7.62, 108.0)), module, ChordRecognizer::VALID_OUTPUT));
+    addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(22.86, 108.0)), module, ChordRecognizer::CHANGED_OUTPUT));
+  }
+};
+
+Model* modelChordRecognizer = createModel<ChordRecognizer, ChordRecognizerWidget>("ChordRecognizer");
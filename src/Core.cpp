@@ -1,6 +1,9 @@
 #include "Core.hpp"
 
 #include <iostream>
+#include <climits>
+#include <fstream>
+#include <sstream>
 
 float Core::getPitchFromVolts(float inVolts, float inRoot, float inScale, int *outRoot, int *outScale, int *outNote, int *outDegree) {
 	
@@ -8,10 +11,6 @@ float Core::getPitchFromVolts(float inVolts, float inRoot, float inScale, int *o
 	int currRoot = getKeyFromVolts(inRoot);
 	int currScale = getScaleFromVolts(inScale);
 
-	if (debug && stepX % poll == 0) {
-		std::cout << "QUANT " << stepX << " Root in: " << inRoot << " Root out: " << currRoot<< " Scale in: " << inScale << " Scale out: " << currScale << std::endl;
-	}	
-	
 	float outVolts = getPitchFromVolts(inVolts, currRoot, currScale, outNote, outDegree);
 	
 	*outRoot = currRoot;
@@ -21,115 +20,192 @@ float Core::getPitchFromVolts(float inVolts, float inRoot, float inScale, int *o
  
 }
 
-float Core::getPitchFromVolts(float inVolts, int currRoot, int currScale, int *outNote, int *outDegree) {
-	
-	int *curScaleArr;
-	int notesInScale = 0;
-	switch (currScale){
-		case SCALE_CHROMATIC:		curScaleArr = ASCALE_CHROMATIC;			notesInScale=LENGTHOF(ASCALE_CHROMATIC); break;
-		case SCALE_IONIAN:			curScaleArr = ASCALE_IONIAN;			notesInScale=LENGTHOF(ASCALE_IONIAN); break;
-		case SCALE_DORIAN:			curScaleArr = ASCALE_DORIAN;			notesInScale=LENGTHOF(ASCALE_DORIAN); break;
-		case SCALE_PHRYGIAN:		curScaleArr = ASCALE_PHRYGIAN;			notesInScale=LENGTHOF(ASCALE_PHRYGIAN); break;
-		case SCALE_LYDIAN:			curScaleArr = ASCALE_LYDIAN;			notesInScale=LENGTHOF(ASCALE_LYDIAN); break;
-		case SCALE_MIXOLYDIAN:		curScaleArr = ASCALE_MIXOLYDIAN;		notesInScale=LENGTHOF(ASCALE_MIXOLYDIAN); break;
-		case SCALE_AEOLIAN:			curScaleArr = ASCALE_AEOLIAN;			notesInScale=LENGTHOF(ASCALE_AEOLIAN); break;
-		case SCALE_LOCRIAN:			curScaleArr = ASCALE_LOCRIAN;			notesInScale=LENGTHOF(ASCALE_LOCRIAN); break;
-		case SCALE_MAJOR_PENTA:		curScaleArr = ASCALE_MAJOR_PENTA;		notesInScale=LENGTHOF(ASCALE_MAJOR_PENTA); break;
-		case SCALE_MINOR_PENTA:		curScaleArr = ASCALE_MINOR_PENTA;		notesInScale=LENGTHOF(ASCALE_MINOR_PENTA); break;
-		case SCALE_HARMONIC_MINOR:	curScaleArr = ASCALE_HARMONIC_MINOR;	notesInScale=LENGTHOF(ASCALE_HARMONIC_MINOR); break;
-		case SCALE_BLUES:			curScaleArr = ASCALE_BLUES;				notesInScale=LENGTHOF(ASCALE_BLUES); break;
-		default: 					curScaleArr = ASCALE_CHROMATIC;			notesInScale=LENGTHOF(ASCALE_CHROMATIC);
-	}
-
-	// get the octave
-	int octave = floor(inVolts);
-	float closestVal = 10.0;
-	float closestDist = 10.0;
-	int noteFound = 0;
-
-	if (debug && stepX % poll == 0) {
-		std::cout << "QUANT Octave: " << octave << " Scale: " << scaleNames[currScale] << " Root: " << noteNames[currRoot] << std::endl;
-	}
-
-	float octaveOffset = 0;
-	if (currRoot != 0) {
-		octaveOffset = (12 - currRoot) / 12.0;
+void Core::getScaleNotes(int scale, const int **notes, int *notesInScale) {
+	switch (scale){
+		case SCALE_CHROMATIC:		*notes = ASCALE_CHROMATIC;			*notesInScale=LENGTHOF(ASCALE_CHROMATIC); break;
+		case SCALE_IONIAN:			*notes = ASCALE_IONIAN;				*notesInScale=LENGTHOF(ASCALE_IONIAN); break;
+		case SCALE_DORIAN:			*notes = ASCALE_DORIAN;				*notesInScale=LENGTHOF(ASCALE_DORIAN); break;
+		case SCALE_PHRYGIAN:		*notes = ASCALE_PHRYGIAN;			*notesInScale=LENGTHOF(ASCALE_PHRYGIAN); break;
+		case SCALE_LYDIAN:			*notes = ASCALE_LYDIAN;				*notesInScale=LENGTHOF(ASCALE_LYDIAN); break;
+		case SCALE_MIXOLYDIAN:		*notes = ASCALE_MIXOLYDIAN;			*notesInScale=LENGTHOF(ASCALE_MIXOLYDIAN); break;
+		case SCALE_AEOLIAN:			*notes = ASCALE_AEOLIAN;			*notesInScale=LENGTHOF(ASCALE_AEOLIAN); break;
+		case SCALE_LOCRIAN:			*notes = ASCALE_LOCRIAN;			*notesInScale=LENGTHOF(ASCALE_LOCRIAN); break;
+		case SCALE_MAJOR_PENTA:		*notes = ASCALE_MAJOR_PENTA;		*notesInScale=LENGTHOF(ASCALE_MAJOR_PENTA); break;
+		case SCALE_MINOR_PENTA:		*notes = ASCALE_MINOR_PENTA;		*notesInScale=LENGTHOF(ASCALE_MINOR_PENTA); break;
+		case SCALE_HARMONIC_MINOR:	*notes = ASCALE_HARMONIC_MINOR;		*notesInScale=LENGTHOF(ASCALE_HARMONIC_MINOR); break;
+		case SCALE_BLUES:			*notes = ASCALE_BLUES;				*notesInScale=LENGTHOF(ASCALE_BLUES); break;
+		default: 					*notes = ASCALE_CHROMATIC;			*notesInScale=LENGTHOF(ASCALE_CHROMATIC);
 	}
-	
-	if (debug && stepX % poll == 0) {
-		std::cout << "QUANT Octave: " << octave << " currRoot: " << currRoot << " -> Offset: " << octaveOffset << " inVolts: " << inVolts << std::endl;
-	}
-		
-	float fOctave = (float)octave - octaveOffset;	
-	int scaleIndex = 0;
-	int searchOctave = 0;
-	
-	do { 
+}
 
-		int degree = curScaleArr[scaleIndex]; // 0 - 11!
-		float fVoltsAboveOctave = searchOctave + degree / 12.0;
-		float fScaleNoteInVolts = fOctave + fVoltsAboveOctave;
-		float distAway = fabs(inVolts - fScaleNoteInVolts);
+Core::QuantizeTables::QuantizeTables() {
+	for (int scale = 0; scale < NUM_SCALES; scale++) {
+		const int *notes;
+		int notesInScale;
+		getScaleNotes(scale, &notes, &notesInScale);
 
-		if (debug && stepX % poll == 0) {
-			std::cout << "QUANT input: " << inVolts
-			<< " index: " << scaleIndex
-			<< " root: " << currRoot
-			<< " octave: " << fOctave
-			<< " degree: " << degree
-			<< " V above O: " << fVoltsAboveOctave
-			<< " note in V: " << fScaleNoteInVolts
-			<< " distance: " << distAway
-			<< std::endl;
+		scaleMasks[scale] = 0;
+		for (int k = 0; k < notesInScale - 1; k++) {
+			scaleMasks[scale] |= 1 << notes[k];
 		}
 
-		// Assume that the list of notes is ordered, so there is an single inflection point at the minimum value
-		if (distAway >= closestDist){
-			break;
-		} else {
-			// Let's remember this
-			closestVal = fScaleNoteInVolts;
-			closestDist = distAway;
+		for (int root = 0; root < 12; root++) {
+			for (int i = 0; i < 25; i++) {
+				// Centre of the bin in quarter semitones above C, entry 0 is bin -1
+				int centre = 2 * (i - 1) + 1;
+				int bestDist = INT_MAX;
+				QuantizeEntry &entry = quantize[scale][root][i];
+
+				// Scale notes from the octave below to the octave above, skipping the repeated octave
+				for (int octave = -1; octave <= 2; octave++) {
+					for (int k = 0; k < notesInScale - 1; k++) {
+						int semitones = 12 * octave + root - 12 + notes[k];
+						// Bin centres are odd, notes even, so there is never a tie here
+						int dist = std::abs(4 * semitones - centre);
+						if (dist < bestDist) {
+							bestDist = dist;
+							entry.semitones = semitones;
+							entry.note = (root + notes[k]) % 12;
+							entry.degree = notes[k];
+						}
+					}
+				}
+			}
 		}
-		
-		scaleIndex++;
-		
-		if (scaleIndex == notesInScale - 1) {
-			scaleIndex = 0;
-			searchOctave++;
+	}
+}
+
+const Core::QuantizeTables *Core::getQuantizeTables() {
+	static const QuantizeTables tables;
+	return &tables;
+}
+
+Core::ChordTables::ChordTables() {
+	for (int mask = 0; mask < NUM_SCALE_MASKS; mask++) {
+		for (int bass = 0; bass < 12; bass++) {
+			chords[mask][bass].chord = 0;
+			chords[mask][bass].root = 0;
 		}
+	}
 
-	} while (true);
+	// Chord 0 is None
+	shapes[0] = 0;
+	for (int c = 1; c < NUM_CHORDS; c++) {
+		int shape = 0;
+		for (int i = 0; i < 6; i++) {
+			// Negative entries repeat chord tones an octave or two down
+			shape |= 1 << (((ChordTable[c].root[i] % 12) + 12) % 12);
+		}
+		shapes[c] = shape;
 
-	if(scaleIndex == 0) {
-		noteFound = notesInScale - 2; // NIS is a count, not index
-	} else {
-		noteFound = scaleIndex - 1;
+		for (int root = 0; root < 12; root++) {
+			int mask = getPitchClasses(shape, root);
+			for (int bass = 0; bass < 12; bass++) {
+				ChordEntry &entry = chords[mask][bass];
+				if (entry.chord == 0 || (entry.root != bass && root == bass)) {
+					entry.chord = c;
+					entry.root = root;
+				}
+			}
+		}
 	}
+}
+
+const Core::ChordTables *Core::getChordTables() {
+	static const ChordTables tables;
+	return &tables;
+}
 
-	if (debug && stepX % poll == 0) {
-		std::cout << "QUANT NIS: " << notesInScale <<  " scaleIndex: " << scaleIndex << " NF: " << noteFound << std::endl;
+float Core::getPitchFromVolts(float inVolts, int currRoot, int currScale, int *outNote, int *outDegree) {
+	
+	if (currScale < 0 || currScale >= NUM_SCALES) {
+		currScale = SCALE_CHROMATIC;
 	}
+	currRoot = ((currRoot % 12) + 12) % 12;
+
+	// Half semitone bins, a value exactly between two scale notes goes to the lower one, which is
+	// always in the bin below
+	float octave = std::floor(inVolts);
+	float x = (inVolts - octave) * 24.f;
+	int bin = (int) x;
+	const QuantizeEntry &entry = tables->quantize[currScale][currRoot][bin + (x != bin)];
+
+	*outNote = entry.note;
+	*outDegree = entry.degree;
 	
-	int currNote = (currRoot + curScaleArr[noteFound]) % 12; // So this is the nth note of the scale; 
-	// case in point, V=0, Scale = F#m returns the 6th note, which should be C#
+	return octave + entry.semitones * SEMITONE;
+ 
+}
 
-	if (debug && stepX % poll == 0) {
-		// Dump the note and degree, mod the size in case where we have wrapped round
+simd::float_4 Core::getPitchFromVolts(simd::float_4 inVolts, const int *inRoot, const int *inScale, simd::float_4 *outNote, simd::float_4 *outDegree) {
 
-		std::cout << "QUANT Found index in scale: " << noteFound << ", currNote: "  << currNote;
-		std::cout << " This is scale note: "  << curScaleArr[noteFound] << " (Interval: " << intervalNames[curScaleArr[noteFound]] << ")";
-		std::cout << ": " << inVolts << " -> " << closestVal << std::endl;
+	// Same bins as the scalar version, computed for all four channels before the table loads
+	simd::float_4 octave = simd::floor(inVolts);
+	simd::float_4 x = (inVolts - octave) * 24.f;
+	// Rounding up is bin + (x != bin), a value exactly on a bin edge stays in the bin below
+	simd::float_4 index = -simd::floor(-x);
 
+	float semitones[4];
+	float notes[4];
+	float degrees[4];
+	for (int i = 0; i < 4; i++) {
+		int currScale = inScale[i];
+		if (currScale < 0 || currScale >= NUM_SCALES) {
+			currScale = SCALE_CHROMATIC;
+		}
+		int currRoot = ((inRoot[i] % 12) + 12) % 12;
+
+		const QuantizeEntry &entry = tables->quantize[currScale][currRoot][(int) index[i]];
+		semitones[i] = entry.semitones;
+		notes[i] = entry.note;
+		degrees[i] = entry.degree;
 	}
 
-	*outNote = currNote;
-	*outDegree = curScaleArr[noteFound];
-	
-	return closestVal;
- 
+	*outNote = simd::float_4::load(notes);
+	*outDegree = simd::float_4::load(degrees);
+
+	return octave + simd::float_4::load(semitones) * SEMITONE;
+
+}
+float Core::getPitchFromMask(float inVolts, int inRoot, int inMask, int *outNote, int *outDegree) {
+
+	int currRoot = ((inRoot % 12) + 12) % 12;
+
+	float octave = std::floor(inVolts);
+	int semitones = getNearestInMask((inVolts - octave) * 12.f - currRoot, inMask);
+	int degree = ((semitones % 12) + 12) % 12;
+
+	*outNote = (currRoot + degree) % 12;
+	*outDegree = degree;
+
+	return octave + (currRoot + semitones) * SEMITONE;
+
 }
 
+simd::float_4 Core::getPitchFromMask(simd::float_4 inVolts, const int *inRoot, const int *inMask, simd::float_4 *outNote, simd::float_4 *outDegree) {
+
+	simd::float_4 octave = simd::floor(inVolts);
+	simd::float_4 x = (inVolts - octave) * 12.f;
+
+	float semitones[4];
+	float notes[4];
+	float degrees[4];
+	for (int i = 0; i < 4; i++) {
+		int currRoot = ((inRoot[i] % 12) + 12) % 12;
+		int nearest = getNearestInMask(x[i] - currRoot, inMask[i]);
+		int degree = ((nearest % 12) + 12) % 12;
+
+		semitones[i] = currRoot + nearest;
+		notes[i] = (currRoot + degree) % 12;
+		degrees[i] = degree;
+	}
+
+	*outNote = simd::float_4::load(notes);
+	*outDegree = simd::float_4::load(degrees);
+
+	return octave + simd::float_4::load(semitones) * SEMITONE;
+
+}
 
 void Core::getRootFromMode(int inMode, int inRoot, int inTonic, int *currRoot, int *quality) {
 	
@@ -164,27 +240,61 @@ void Core::getRootFromMode(int inMode, int inRoot, int inTonic, int *currRoot, i
 	// 	<< std::endl;
  }
  
- Core & CoreUtil() {
-     static Core core;
-     return core;
+ // Marsaglia and Tsang, The Ziggurat Method for Generating Random Variables, 2000
+ RandomGenerator::ZigguratTables::ZigguratTables() {
+ 	const double m1 = 2147483648.0;
+ 	const double vn = 9.91256303526217e-3;
+ 	double dn = 3.442619855899;
+ 	double tn = dn;
+ 	double q = vn / exp(-.5 * dn * dn);
+
+ 	k[0] = (dn / q) * m1;
+ 	k[1] = 0;
+ 	w[0] = q / m1;
+ 	w[ZIGGURAT_LAYERS - 1] = dn / m1;
+ 	f[0] = 1.;
+ 	f[ZIGGURAT_LAYERS - 1] = exp(-.5 * dn * dn);
+
+ 	for (int i = ZIGGURAT_LAYERS - 2; i >= 1; i--) {
+ 		dn = sqrt(-2. * log(vn / dn + exp(-.5 * dn * dn)));
+ 		k[i + 1] = (dn / tn) * m1;
+ 		tn = dn;
+ 		f[i] = exp(-.5 * dn * dn);
+ 		w[i] = dn / m1;
+ 	}
  }
- 
- //	http://c-faq.com/lib/gaussian.html
- double Core::gaussrand() {
- 	static double U, V;
- 	static int phase = 0;
- 	double Z;
-
- 	if(phase == 0) {
- 		U = (rand() + 1.) / (RAND_MAX + 2.);
- 		V = rand() / (RAND_MAX + 1.);
- 		Z = sqrt(-2 * log(U)) * sin(2 * M_PI * V);
- 	} else
- 		Z = sqrt(-2 * log(U)) * cos(2 * M_PI * V);
-
- 	phase = 1 - phase;
-
- 	return Z;
+
+ const RandomGenerator::ZigguratTables *RandomGenerator::getZigguratTables() {
+ 	static const ZigguratTables tables;
+ 	return &tables;
+ }
+
+ float RandomGenerator::normalSlow(int32_t hz, int iz) {
+ 	const float r = 3.442620f;
+ 	const ZigguratTables &t = *zigguratTables;
+
+ 	for (;;) {
+ 		float x = hz * t.w[iz];
+ 		if (iz == 0) {
+ 			// Tail beyond r, 1 - uniform() is never 0
+ 			float y;
+ 			do {
+ 				x = -std::log(1.f - uniform()) / r;
+ 				y = -std::log(1.f - uniform());
+ 			} while (y + y < x * x);
+ 			return hz > 0 ? r + x : -r - x;
+ 		}
+ 		if (t.f[iz] + uniform() * (t.f[iz - 1] - t.f[iz]) < std::exp(-.5f * x * x)) {
+ 			return x;
+ 		}
+
+ 		uint64_t u = u64();
+ 		hz = u >> 32;
+ 		iz = u & (ZIGGURAT_LAYERS - 1);
+ 		if (absolute(hz) < t.k[iz]) {
+ 			return hz * t.w[iz];
+ 		}
+ 	}
  }
  
  int Core::ipow(int base, int exp) {
@@ -200,3 +310,159 @@ void Core::getRootFromMode(int inMode, int inRoot, int inTonic, int *currRoot, i
      return result;
  }
  
+/*
+ * Non-comment lines of a Scala file, with leading whitespace removed.
+ */
+static bool readScalaLines(const std::string &filename, std::vector<std::string> *lines) {
+	std::ifstream file(filename);
+	if (!file) {
+		return false;
+	}
+	std::string line;
+	while (std::getline(file, line)) {
+		if (!line.empty() && line.back() == '\r') {
+			line.pop_back();
+		}
+		if (!line.empty() && line[0] == '!') {
+			continue;
+		}
+		size_t start = line.find_first_not_of(" \t");
+		lines->push_back(start == std::string::npos ? "" : line.substr(start));
+	}
+	return true;
+}
+
+/*
+ * A pitch is in cents if it has a period, otherwise it is a ratio like 3/2 or 2.
+ */
+static bool parseScalaPitch(const std::string &line, float *cents) {
+	std::string token = line.substr(0, line.find_first_of(" \t"));
+	if (token.empty()) {
+		return false;
+	}
+	char *end;
+	if (token.find('.') != std::string::npos) {
+		*cents = strtof(token.c_str(), &end);
+		return *end == '\0';
+	}
+	long num = strtol(token.c_str(), &end, 10);
+	long den = 1;
+	if (*end == '/') {
+		den = strtol(end + 1, &end, 10);
+	}
+	if (*end != '\0' || num <= 0 || den <= 0) {
+		return false;
+	}
+	*cents = 1200.f * std::log2((double) num / den);
+	return true;
+}
+
+ScalaTuning *ScalaTuning::load(const std::string &sclFile, const std::string &kbmFile) {
+
+	std::vector<std::string> lines;
+	if (!readScalaLines(sclFile, &lines) || lines.size() < 2) {
+		return NULL;
+	}
+	int count = atoi(lines[1].c_str());
+	if (count < 1 || (int) lines.size() < 2 + count) {
+		return NULL;
+	}
+
+	// Degree 0 is always 0 cents, the last pitch of the file is the period
+	std::vector<float> scale(1, 0.f);
+	for (int i = 0; i < count; i++) {
+		float c;
+		if (!parseScalaPitch(lines[2 + i], &c)) {
+			return NULL;
+		}
+		scale.push_back(c);
+	}
+	float scalePeriod = scale.back();
+	scale.pop_back();
+	if (scalePeriod <= 0.f) {
+		return NULL;
+	}
+
+	auto degreeCents = [&](int degree) {
+		int periods = (int) std::floor((float) degree / count);
+		return periods * scalePeriod + scale[degree - periods * count];
+	};
+
+	// Keyboard mapping, by default every degree in order from degree 0
+	std::vector<int> mapping;
+	int middleNote = 60;
+	int referenceNote = 60;
+	float referenceFrequency = 261.6256f;
+	float period = scalePeriod;
+	if (!kbmFile.empty()) {
+		std::vector<std::string> kbm;
+		if (!readScalaLines(kbmFile, &kbm) || kbm.size() < 7) {
+			return NULL;
+		}
+		int mapSize = atoi(kbm[0].c_str());
+		middleNote = atoi(kbm[3].c_str());
+		referenceNote = atoi(kbm[4].c_str());
+		referenceFrequency = atof(kbm[5].c_str());
+		int octaveDegree = atoi(kbm[6].c_str());
+		if (mapSize < 0 || referenceFrequency <= 0.f) {
+			return NULL;
+		}
+		// Missing entries are unmapped like x
+		for (int i = 0; i < mapSize; i++) {
+			bool mapped = 7 + i < (int) kbm.size() && !kbm[7 + i].empty() && kbm[7 + i][0] != 'x';
+			mapping.push_back(mapped ? atoi(kbm[7 + i].c_str()) : -1);
+		}
+		if (mapSize > 0 && octaveDegree > 0) {
+			period = degreeCents(octaveDegree);
+		}
+	}
+	if (mapping.empty()) {
+		for (int i = 0; i < count; i++) {
+			mapping.push_back(i);
+		}
+	}
+	if (period <= 0.f) {
+		return NULL;
+	}
+
+	ScalaTuning *tuning = new ScalaTuning;
+	tuning->description = lines[0];
+	tuning->period = period;
+
+	std::vector<std::pair<float, int>> pitches;
+	for (int degree : mapping) {
+		if (degree >= 0) {
+			float c = degreeCents(degree);
+			pitches.push_back(std::make_pair(c - std::floor(c / period) * period, degree % count));
+		}
+	}
+	if (pitches.empty()) {
+		delete tuning;
+		return NULL;
+	}
+	std::sort(pitches.begin(), pitches.end());
+	for (const auto &p : pitches) {
+		if (tuning->cents.empty() || p.first - tuning->cents.back() > 1e-3f) {
+			tuning->cents.push_back(p.first);
+			tuning->degrees.push_back(p.second);
+		}
+	}
+
+	// Place degree 0 so the reference note sounds at the reference frequency, 0V is C4
+	int key = referenceNote - middleNote;
+	int keyPeriods = (int) std::floor((float) key / mapping.size());
+	int entry = mapping[key - keyPeriods * (int) mapping.size()];
+	float referenceCents = entry >= 0 ? keyPeriods * period + degreeCents(entry) : key * 100.f;
+	tuning->offset = std::log2(referenceFrequency / 261.6256f) - referenceCents / 1200.f;
+
+	int n = tuning->cents.size();
+	for (int b = 0, i = 0; b <= NUM_BUCKETS; b++) {
+		while (i < n && tuning->cents[i] < b * period / NUM_BUCKETS) {
+			i++;
+		}
+		tuning->bucketStart[b] = i;
+	}
+	tuning->bucketStart[NUM_BUCKETS] = n;
+
+	return tuning;
+}
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <iostream>
+#include <algorithm>
+#include <vector>
+#include <string_view>
 
 // #include "dsp/digital.hpp"
 
@@ -92,9 +95,450 @@ struct BpmCalculator {
 };
 
 
+/*
+ * Follows a clock input: counts pulses, measures the time between them and reports how far the
+ * current pulse has progressed. Without a clock connected it runs free at the last measured period.
+ */
+struct ClockTracker {
+
+	dsp::SchmittTrigger clockTrigger;
+	float period = 0.5f;
+	float sincePulse = 0.f;
+	uint32_t pulses = 0;
+
+	void reset() {
+		sincePulse = 0.f;
+		pulses = 0;
+	}
+
+	bool process(float sampleTime, float voltage, bool connected) {
+		sincePulse += sampleTime;
+		bool pulse;
+		if (connected) {
+			pulse = clockTrigger.process(voltage, 0.1f, 2.0f);
+			// Ignore the first pulse after a long gap, it says nothing about the tempo
+			if (pulse && pulses > 0 && sincePulse < 4.0f) {
+				period = sincePulse;
+			}
+		} else {
+			pulse = sincePulse >= period;
+		}
+		if (pulse) {
+			sincePulse = 0.f;
+			pulses++;
+		}
+		return pulse;
+	}
+
+	/*
+	 * Fraction of the current pulse elapsed, held just below 1 if the next pulse is late.
+	 */
+	float phase() const {
+		return std::min(sincePulse / period, 0.999f);
+	}
+
+};
+
+/*
+ * Phase-locked loop that turns a clock input of pulsesPerBeat pulses per beat into evenly spaced
+ * ticks. The loop follows the average tempo and phase of the input, so jitter on individual pulses
+ * doesn't move the ticks, and it is seeded from the last pulse interval whenever it has to lock
+ * again. pulsesPerBeat has to divide ticksPerBeat.
+ */
+struct ClockPll {
+
+	enum Events {
+		TICK = 1,
+		START = 2,
+		STOP = 4
+	};
+
+	static constexpr float KP = 0.3f; // share of the phase error corrected over the next pulse
+	static constexpr float KI = 0.05f; // share of the phase error taken into the tempo
+
+	int ticksPerBeat = 24;
+	int pulsesPerBeat = 1;
+	bool running = false;
+
+	void reset() {
+		running = false;
+		position = 0.f;
+		corr = 0.f;
+		sincePulse = 0.f;
+		interval = 0.f;
+	}
+
+	/*
+	 * Called every sample with whether a pulse was detected, returns the Events that happen in this
+	 * sample.
+	 */
+	int process(float sampleTime, bool pulse, bool connected) {
+		int events = 0;
+		sincePulse += sampleTime;
+
+		int ticksPerPulse = ticksPerBeat / pulsesPerBeat;
+		if (pulse) {
+			if (!running) {
+				running = true;
+				lock();
+				events |= START;
+			} else {
+				interval = sincePulse;
+				// The pulse should land on position 1, the start of the next pulse
+				float e = 1.f - position;
+				if (std::fabs(e) > 0.5f) {
+					lock();
+				} else {
+					freq += KI * e * freq;
+					corr = KP * e * freq;
+					position -= 1.f;
+					lastTick -= ticksPerPulse;
+				}
+			}
+			sincePulse = 0.f;
+		}
+
+		// Stop when the clock is unplugged or has missed two pulses
+		if (running && (!connected || sincePulse * freq > 2.f)) {
+			running = false;
+			return events | STOP;
+		}
+
+		if (running) {
+			position += (freq + corr) * sampleTime;
+			int tick = (int) std::floor(position * ticksPerPulse);
+			if (tick > lastTick) {
+				lastTick = tick;
+				events |= TICK;
+			}
+		}
+		return events;
+	}
+
+	float getBpm() const {
+		return running ? 60.f * freq / pulsesPerBeat : 0.f;
+	}
+
+	private:
+
+	float position = 0.f; // pulses since the last pulse
+	float freq = 2.f; // pulses per second
+	float corr = 0.f; // phase correction spread over the current pulse, pulses per second
+	float sincePulse = 0.f;
+	float interval = 0.f; // seconds between the last two pulses while running, 0 when unknown
+	int lastTick = -1;
+
+	void lock() {
+		if (interval > 2.0e-05f) {
+			freq = 1.f / interval;
+		}
+		position = 0.f;
+		corr = 0.f;
+		lastTick = -1;
+	}
+
+};
+
+/*
+ * Holds four channels of a quantizer on their note until the input is more than width volts past the
+ * boundary to a new note, so an input resting on a boundary doesn't flip every sample. With a width
+ * of 0 every new nearest note is taken straight away. A held note is dropped as soon as the
+ * quantizer's pitch classes change or no longer contain it.
+ */
+struct QuantizerHysteresis {
+	simd::float_4 volts = 0.f;
+	simd::float_4 note = 0.f;
+	simd::float_4 degree = 0.f;
+	int pitchClasses[4] = {-1, -1, -1, -1};
+
+	/*
+	 * Forget the held notes, for settings that pitchClasses can't describe such as a new tuning.
+	 */
+	void reset() {
+		for (int i = 0; i < 4; i++) {
+			pitchClasses[i] = -1;
+		}
+	}
+
+	/*
+	 * Replaces the quantized values for the input with the held ones, returns a mask of the channels
+	 * that moved to a new note. inPitchClasses is the set of notes each channel quantizes to, bit n
+	 * for pitch class n (C = 0).
+	 */
+	simd::float_4 process(simd::float_4 in, simd::float_4 width, const int *inPitchClasses, simd::float_4 *outVolts, simd::float_4 *outNote, simd::float_4 *outDegree) {
+		float drop[4];
+		for (int i = 0; i < 4; i++) {
+			drop[i] = inPitchClasses[i] != pitchClasses[i] || !(inPitchClasses[i] & (1 << (int) note[i]));
+			pitchClasses[i] = inPitchClasses[i];
+		}
+		// width past the boundary the held note is 2 * width further away than the new one
+		simd::float_4 changed = (*outVolts != volts) & ((simd::float_4::load(drop) != 0.f) | (simd::fabs(in - volts) - simd::fabs(in - *outVolts) > 2.f * width));
+		volts = simd::ifelse(changed, *outVolts, volts);
+		note = simd::ifelse(changed, *outNote, note);
+		degree = simd::ifelse(changed, *outDegree, degree);
+
+		*outVolts = volts;
+		*outNote = note;
+		*outDegree = degree;
+		return changed;
+	}
+};
+
+/*
+ * A microtonal tuning loaded from a Scala .scl file, optionally mapped to the keyboard with a .kbm
+ * file. One period of pitches is kept as a sorted cents table, bucketed so a lookup only searches
+ * the few pitches of one bucket. Degree 0 sits at 0V (C4) unless the mapping moves it.
+ */
+struct ScalaTuning {
+
+	static const int NUM_BUCKETS = 64;
+
+	std::string description;
+	std::vector<float> cents;	// sorted, in [0, period)
+	std::vector<int> degrees;	// scale degree of each entry of cents
+	float period = 1200.f;
+	float offset = 0.f;			// volts of degree 0
+	int bucketStart[NUM_BUCKETS + 1] = {};
+
+	/*
+	 * Parse a .scl file and an optional .kbm file (empty name for none), returns NULL if either
+	 * can't be read. UI thread only.
+	 */
+	static ScalaTuning *load(const std::string &sclFile, const std::string &kbmFile);
+
+	float getPitchFromVolts(float inVolts, int *outDegree) const {
+		float c = (inVolts - offset) * 1200.f;
+		float periods = std::floor(c / period);
+		float r = c - periods * period;
+
+		int n = cents.size();
+		int bucket = clamp((int) (r * NUM_BUCKETS / period), 0, NUM_BUCKETS - 1);
+		// First pitch above r, the pitches of later buckets are all above it
+		int i = std::upper_bound(cents.begin() + bucketStart[bucket], cents.begin() + bucketStart[bucket + 1], r) - cents.begin();
+		float below = i > 0 ? cents[i - 1] : cents[n - 1] - period;
+		float above = i < n ? cents[i] : cents[0] + period;
+
+		float nearest;
+		if (r - below <= above - r) {
+			nearest = below;
+			i = i > 0 ? i - 1 : n - 1;
+		} else {
+			nearest = above;
+			i = i < n ? i : 0;
+		}
+		*outDegree = degrees[i];
+
+		return offset + (periods * period + nearest) / 1200.f;
+	}
+
+};
+
+/*
+ * Seedable per-instance random numbers. Scalar values come from xoshiro256**, float_4 values from four
+ * xoshiro128** lanes updated side by side. Gaussians use the Ziggurat method with 128 layers, which
+ * costs a table lookup and a multiply for about 99% of the values.
+ */
+struct RandomGenerator {
+
+	static const int ZIGGURAT_LAYERS = 128;
+
+	/*
+	 * Layer tables, built once on first use and read-only after that.
+	 */
+	struct ZigguratTables {
+		uint32_t k[ZIGGURAT_LAYERS];
+		float w[ZIGGURAT_LAYERS];
+		float f[ZIGGURAT_LAYERS];
+
+		ZigguratTables();
+	};
+
+	static const ZigguratTables *getZigguratTables();
+
+	const ZigguratTables *zigguratTables = getZigguratTables();
+
+	uint64_t state[4];
+	uint32_t laneState[4][4];	// [word][lane]
+
+	RandomGenerator(uint64_t s = 0) {
+		seed(s);
+	}
+
+	void seed(uint64_t s) {
+		// splitmix64, so similar seeds still give unrelated states
+		auto next = [&s]() {
+			uint64_t z = (s += 0x9e3779b97f4a7c15ULL);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			return z ^ (z >> 31);
+		};
+		for (int i = 0; i < 4; i++) {
+			state[i] = next();
+		}
+		for (int i = 0; i < 4; i += 2) {
+			for (int lane = 0; lane < 4; lane++) {
+				uint64_t z = next();
+				laneState[i][lane] = z;
+				laneState[i + 1][lane] = z >> 32;
+			}
+		}
+	}
+
+	static uint64_t rotl(uint64_t x, int k) {
+		return (x << k) | (x >> (64 - k));
+	}
+
+	static uint32_t rotl(uint32_t x, int k) {
+		return (x << k) | (x >> (32 - k));
+	}
+
+	uint64_t u64() {
+		uint64_t result = rotl(state[1] * 5, 7) * 9;
+		uint64_t t = state[1] << 17;
+		state[2] ^= state[0];
+		state[3] ^= state[1];
+		state[1] ^= state[2];
+		state[0] ^= state[3];
+		state[2] ^= t;
+		state[3] = rotl(state[3], 45);
+		return result;
+	}
+
+	// One xoshiro128** step on each lane, written so the compiler can vectorize it
+	void u32x4(uint32_t *out) {
+		for (int lane = 0; lane < 4; lane++) {
+			out[lane] = rotl(laneState[1][lane] * 5, 7) * 9;
+			uint32_t t = laneState[1][lane] << 9;
+			laneState[2][lane] ^= laneState[0][lane];
+			laneState[3][lane] ^= laneState[1][lane];
+			laneState[1][lane] ^= laneState[2][lane];
+			laneState[0][lane] ^= laneState[3][lane];
+			laneState[2][lane] ^= t;
+			laneState[3][lane] = rotl(laneState[3][lane], 11);
+		}
+	}
+
+	// [0, 1)
+	float uniform() {
+		return (u64() >> 40) * 0x1p-24f;
+	}
+
+	simd::float_4 uniform4() {
+		uint32_t r[4];
+		u32x4(r);
+		float out[4];
+		for (int lane = 0; lane < 4; lane++) {
+			out[lane] = (r[lane] >> 8) * 0x1p-24f;
+		}
+		return simd::float_4::load(out);
+	}
+
+	// Mean 0, standard deviation 1
+	float normal() {
+		uint64_t r = u64();
+		int32_t hz = r >> 32;
+		int iz = r & (ZIGGURAT_LAYERS - 1);
+		if (absolute(hz) < zigguratTables->k[iz]) {
+			return hz * zigguratTables->w[iz];
+		}
+		return normalSlow(hz, iz);
+	}
+
+	simd::float_4 normal4() {
+		uint32_t r[4];
+		u32x4(r);
+		float out[4];
+		for (int lane = 0; lane < 4; lane++) {
+			// Only 32 bits per lane, so the layer and the position in it take separate bits
+			int iz = r[lane] & (ZIGGURAT_LAYERS - 1);
+			int32_t hz = r[lane] & ~(uint32_t) (ZIGGURAT_LAYERS - 1);
+			out[lane] = absolute(hz) < zigguratTables->k[iz] ? hz * zigguratTables->w[iz] : normalSlow(hz, iz);
+		}
+		return simd::float_4::load(out);
+	}
+
+	static uint32_t absolute(int32_t x) {
+		return x < 0 ? -(uint32_t) x : x;
+	}
+
+	// Values outside the rectangle of their layer, including the tail
+	float normalSlow(int32_t hz, int iz);
+
+};
+
+/*
+ * A bank of N random modulation sources stepped together in float_4 blocks. Each slot is off, a
+ * smoothed random walk, or sample and hold that takes a new value on every clock. Outputs are in
+ * -depth..depth.
+ */
+template <int N>
+struct RandomModulators {
+
+	static const int BLOCKS = (N + 3) / 4;
+
+	enum Modes {
+		OFF,
+		WALK,
+		SAMPLE_HOLD,
+		NUM_MODES
+	};
+
+	// Settings, picked up on the next process()
+	int mode[N] = {};
+	float depth[N] = {};
+	float rate = 1.f;	// Hz, how fast the walks move and the internal sample and hold clock
+
+	RandomGenerator rng;
+
+	simd::float_4 walk[BLOCKS] = {};
+	simd::float_4 smooth[BLOCKS] = {};
+	simd::float_4 held[BLOCKS] = {};
+	float walkDepth[BLOCKS * 4] = {};
+	float holdDepth[BLOCKS * 4] = {};
+	float out[BLOCKS * 4] = {};
+	float phase = 0.f;
+
+	/*
+	 * Step every slot by dt seconds. Without an external clock sample and hold runs at rate.
+	 */
+	void process(float dt, bool externalClock, bool clocked) {
+		if (!externalClock) {
+			phase += dt * rate;
+			clocked = phase >= 1.f;
+			if (clocked) {
+				phase -= std::floor(phase);
+			}
+		}
+
+		for (int i = 0; i < N; i++) {
+			walkDepth[i] = mode[i] == WALK ? depth[i] : 0.f;
+			holdDepth[i] = mode[i] == SAMPLE_HOLD ? depth[i] : 0.f;
+		}
+
+		// The walk spreads about one unit per 1 / rate seconds, and is smoothed at 4 * rate
+		float step = std::sqrt(dt * rate);
+		float lambda = 1.f - std::exp(-2.f * M_PI * 4.f * rate * dt);
+		for (int b = 0; b < BLOCKS; b++) {
+			simd::float_4 w = walk[b] + rng.normal4() * step;
+			// Reflect at +-1, so the walk stays in range without sticking to the ends
+			w = simd::ifelse(w > 1.f, 2.f - w, w);
+			w = simd::ifelse(w < -1.f, -2.f - w, w);
+			walk[b] = w;
+			smooth[b] += (w - smooth[b]) * lambda;
+			if (clocked) {
+				held[b] = rng.uniform4() * 2.f - 1.f;
+			}
+
+			simd::float_4 v = smooth[b] * simd::float_4::load(walkDepth + 4 * b) + held[b] * simd::float_4::load(holdDepth + 4 * b);
+			v.store(out + 4 * b);
+		}
+	}
+
+};
+
 struct ChordDef {
 	int number;
-	std::string quality;
+	std::string_view quality;
 	int	root[6];
 	int	first[6];
 	int	second[6];
@@ -123,18 +567,18 @@ struct Core {
 	// http://www.grantmuller.com/MidiReference/doc/midiReference/ScaleReference.html
 	// Although their definition of the Blues scale is wrong
 	// Added the octave note to ensure that the last note is correctly processed
-	int ASCALE_CHROMATIC      [13]= {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12}; 	// All of the notes
-	int ASCALE_IONIAN         [8] = {0, 2, 4, 5, 7, 9, 11, 12};			// 1,2,3,4,5,6,7
-	int ASCALE_DORIAN         [8] = {0, 2, 3, 5, 7, 9, 10, 12};			// 1,2,b3,4,5,6,b7
-	int ASCALE_PHRYGIAN       [8] = {0, 1, 3, 5, 7, 8, 10, 12};			// 1,b2,b3,4,5,b6,b7
-	int ASCALE_LYDIAN         [8] = {0, 2, 4, 6, 7, 9, 10, 12};			// 1,2,3,#4,5,6,7
-	int ASCALE_MIXOLYDIAN     [8] = {0, 2, 4, 5, 7, 9, 10, 12};			// 1,2,3,4,5,6,b7 
-	int ASCALE_AEOLIAN        [8] = {0, 2, 3, 5, 7, 8, 10, 12};			// 1,2,b3,4,5,b6,b7
-	int ASCALE_LOCRIAN        [8] = {0, 1, 3, 5, 6, 8, 10, 12};			// 1,b2,b3,4,b5,b6,b7
-	int ASCALE_MAJOR_PENTA    [6] = {0, 2, 4, 7, 9, 12};				// 1,2,3,5,6
-	int ASCALE_MINOR_PENTA    [6] = {0, 3, 5, 7, 10, 12};				// 1,b3,4,5,b7
-	int ASCALE_HARMONIC_MINOR [8] = {0, 2, 3, 5, 7, 8, 11, 12};			// 1,2,b3,4,5,b6,7
-	int ASCALE_BLUES          [7] = {0, 3, 5, 6, 7, 10, 12};			// 1,b3,4,b5,5,b7
+	static constexpr int ASCALE_CHROMATIC      [13]= {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12}; 	// All of the notes
+	static constexpr int ASCALE_IONIAN         [8] = {0, 2, 4, 5, 7, 9, 11, 12};			// 1,2,3,4,5,6,7
+	static constexpr int ASCALE_DORIAN         [8] = {0, 2, 3, 5, 7, 9, 10, 12};			// 1,2,b3,4,5,6,b7
+	static constexpr int ASCALE_PHRYGIAN       [8] = {0, 1, 3, 5, 7, 8, 10, 12};			// 1,b2,b3,4,5,b6,b7
+	static constexpr int ASCALE_LYDIAN         [8] = {0, 2, 4, 6, 7, 9, 10, 12};			// 1,2,3,#4,5,6,7
+	static constexpr int ASCALE_MIXOLYDIAN     [8] = {0, 2, 4, 5, 7, 9, 10, 12};			// 1,2,3,4,5,6,b7 
+	static constexpr int ASCALE_AEOLIAN        [8] = {0, 2, 3, 5, 7, 8, 10, 12};			// 1,2,b3,4,5,b6,b7
+	static constexpr int ASCALE_LOCRIAN        [8] = {0, 1, 3, 5, 6, 8, 10, 12};			// 1,b2,b3,4,b5,b6,b7
+	static constexpr int ASCALE_MAJOR_PENTA    [6] = {0, 2, 4, 7, 9, 12};				// 1,2,3,5,6
+	static constexpr int ASCALE_MINOR_PENTA    [6] = {0, 3, 5, 7, 10, 12};				// 1,b3,4,5,b7
+	static constexpr int ASCALE_HARMONIC_MINOR [8] = {0, 2, 3, 5, 7, 8, 11, 12};			// 1,2,b3,4,5,b6,7
+	static constexpr int ASCALE_BLUES          [7] = {0, 3, 5, 6, 7, 10, 12};			// 1,b3,4,b5,5,b7
 
 	enum Notes {
 		NOTE_C = 0,
@@ -152,7 +596,7 @@ struct Core {
 		NUM_NOTES
 	};
 
-	int CIRCLE_FIFTHS [12] = {
+	static constexpr int CIRCLE_FIFTHS [12] = {
 		NOTE_C,
 		NOTE_G,
 		NOTE_D,
@@ -167,7 +611,7 @@ struct Core {
 		NOTE_F
 	};
 	
-	std::string noteNames[12] = {
+	static constexpr std::string_view noteNames[12] = {
 		"C",
 		"C#/Db",
 		"D",
@@ -198,7 +642,7 @@ struct Core {
 		NUM_SCALES
 	};
 
-	std::string scaleNames[12] = {
+	static constexpr std::string_view scaleNames[12] = {
 		"Chromatic",
 		"Ionian (Major)",
 		"Dorian",
@@ -213,7 +657,7 @@ struct Core {
 		"Blues"
 	};
 
-	std::string intervalNames[13] {
+	static constexpr std::string_view intervalNames[13] {
 		"1",
 		"b2",
 		"2",
@@ -240,7 +684,7 @@ struct Core {
 		NUM_MODES
 	};
 	
-	std::string modeNames[7] {
+	static constexpr std::string_view modeNames[7] {
 		"Ionian (Major)",
 		"Dorian",
 		"Phrygian",
@@ -261,7 +705,7 @@ struct Core {
 		NUM_DEGREES
 	};		
 	
-	std::string degreeNames[21] { // Degree * 3 + Quality
+	static constexpr std::string_view degreeNames[21] { // Degree * 3 + Quality
 		"I",
 		"i",
 		"i°",
@@ -292,7 +736,7 @@ struct Core {
 		NUM_INV
 	};
 	
-	std::string inversionNames[5] {
+	static constexpr std::string_view inversionNames[5] {
 		"",
 		"(1)",
 		"(2)"
@@ -305,20 +749,27 @@ struct Core {
 		NUM_QUALITY
 	};
 
-	std::string qualityNames[3] {
+	static constexpr std::string_view qualityNames[3] {
 		"Maj",
 		"Min",
 		"Dim"
 	};
 		
 		
-	double gaussrand();
-	
+	Core() {
+		seed(random::u64());
+	}
+
+	/*
+	 * Random numbers for this instance, each Core gives its own reproducible sequence after seed().
+	 */
+	RandomGenerator rng;
+
+	void seed(uint64_t s) {
+		rng.seed(s);
+	}
+
 	int ipow(int base, int exp);
-		
-	bool debug = false;
-	int poll = 100000;
-	int stepX = 0;
 	
 	/*
 	* Convert a V/OCT voltage to a quantized pitch, key and scale, and calculate various information about the quantised note.
@@ -327,6 +778,97 @@ struct Core {
 	float getPitchFromVolts(float inVolts, int inRoot, int inScale, int *outNote, int *outDegree);
 
 	float getPitchFromVolts(float inVolts, float inRoot, float inScale, int *outRoot, int *outScale, int *outNote, int *outDegree);
+
+	/*
+	* Quantize four channels at once, each with its own root and scale. Notes and degrees are returned as semitones.
+	*/
+	simd::float_4 getPitchFromVolts(simd::float_4 inVolts, const int *inRoot, const int *inScale, simd::float_4 *outNote, simd::float_4 *outDegree);
+
+	/*
+	 * Nearest scale note for every half semitone bin of an octave, per scale and root. Entry 0 is the
+	 * last bin of the octave below and entry 24 the first bin of the octave above, see getPitchFromVolts.
+	 */
+	struct QuantizeEntry {
+		int8_t semitones; // above C of the input's octave, can be below 0 or above 11
+		int8_t note;
+		int8_t degree;
+	};
+
+	/*
+	 * Scales as 12 bit pitch class sets, bit 0 is the root and bit 11 the major seventh above it. All
+	 * 4096 masks can be used directly without any table, an empty mask quantizes chromatically.
+	 */
+	static const int NUM_SCALE_MASKS = 4096;
+
+	/*
+	 * Built once on first use and never written after that, so every Core on every engine thread
+	 * shares the same copy without locking.
+	 */
+	struct QuantizeTables {
+		QuantizeEntry quantize[NUM_SCALES][12][25];
+		int scaleMasks[NUM_SCALES];
+
+		QuantizeTables();
+	};
+
+	static const QuantizeTables *getQuantizeTables();
+
+	const QuantizeTables *tables = getQuantizeTables();
+
+	float getPitchFromMask(float inVolts, int inRoot, int inMask, int *outNote, int *outDegree);
+
+	simd::float_4 getPitchFromMask(simd::float_4 inVolts, const int *inRoot, const int *inMask, simd::float_4 *outNote, simd::float_4 *outDegree);
+
+	/*
+	 * Pitch classes of a mask played from root, bit n is pitch class n (C = 0). An empty mask is
+	 * chromatic, as it quantizes.
+	 */
+	static int getPitchClasses(int mask, int root) {
+		mask &= 0xfff;
+		if (!mask) {
+			return 0xfff;
+		}
+		root = ((root % 12) + 12) % 12;
+		return ((mask << root) | (mask >> (12 - root))) & 0xfff;
+	}
+
+	/*
+	 * Nearest note of the mask to t semitones above the root, ties go to the lower note.
+	 */
+	static int getNearestInMask(float t, int mask) {
+		uint32_t set = mask & 0xfff;
+		if (!set) {
+			set = 0xfff;
+		}
+		// Two copies of the octave, so both searches always find a note
+		uint32_t doubled = set | (set << 12);
+
+		int step = (int) std::floor(t);
+		int degree = ((step % 12) + 12) % 12;
+		int down = degree + 12 - (31 - __builtin_clz(doubled & ((2u << (degree + 12)) - 1)));
+		int up = __builtin_ctz(doubled >> (degree + 1)) + 1;
+
+		int low = step - down;
+		int high = step + up;
+		return (t - low <= high - t) ? low : high;
+	}
+
+	int getScaleMask(int scale) {
+		if (scale < 0 || scale >= NUM_SCALES) {
+			scale = SCALE_CHROMATIC;
+		}
+		return tables->scaleMasks[scale];
+	}
+
+	float getVoltsFromMask(int mask) {
+		return rescale(mask, 0.0f, NUM_SCALE_MASKS - 1, 0.0f, 10.0f);
+	}
+
+	int getMaskFromVolts(float volts) {
+		return round(rescale(clamp(volts, 0.0f, 10.0f), 0.0f, 10.0f, 0.0f, NUM_SCALE_MASKS - 1));
+	}
+
+	static void getScaleNotes(int scale, const int **notes, int *notesInScale);
 	
 	/*
  	 * Convert a root note (relative to C, C=0) and positive semi-tone offset from that root to a voltage (1V/OCT, 0V = C4 (or 3??))
@@ -365,7 +907,7 @@ struct Core {
 	
 	const static int NUM_CHORDS = 99;
 
-	ChordDef ChordTable[NUM_CHORDS] {
+	static constexpr ChordDef ChordTable[NUM_CHORDS] {
 		{	0	,"None",{	-24	,	-24	,	-24	,	-24	,	-24	,	-24	},{	-24	,	-24	,	-24	,	-24	,	-24	,	-24	},{	-24	,	-24	,	-24	,	-24	,	-24	,	-24	}},
 		{	1	,"",{	0	,	4	,	7	,	-24	,	-20	,	-17	},{	12	,	4	,	7	,	-12	,	-20	,	-17	},{	12	,	16	,	7	,	-12	,	-8	,	-17	}},
 		{	2	,"M#5",{	0	,	4	,	8	,	-24	,	-20	,	-16	},{	12	,	4	,	8	,	-12	,	-20	,	-16	},{	12	,	16	,	8	,	-12	,	-8	,	-16	}},
@@ -466,8 +1008,46 @@ struct Core {
 		{	97	,"madd4",{	0	,	3	,	5	,	7	,	-24	,	-21	},{	12	,	3	,	5	,	7	,	-24	,	-21	},{	12	,	15	,	5	,	7	,	-12	,	-21	}},
 		{	98	,"madd9",{	0	,	3	,	7	,	14	,	-24	,	-21	},{	12	,	3	,	7	,	14	,	-24	,	-21	},{	12	,	15	,	7	,	14	,	-12	,	-21	}},		
 	};
+
+	/*
+	 * Chord for every set of pitch classes and bass note, from the root position shapes of ChordTable
+	 * in all 12 rotations. When several shapes have the same notes, the first one in ChordTable with
+	 * the bass as its root wins, and the first one in ChordTable if none has.
+	 */
+	struct ChordEntry {
+		uint8_t chord;	// ChordTable index, 0 if the set is not a chord
+		int8_t root;
+	};
+
+	struct ChordTables {
+		ChordEntry chords[NUM_SCALE_MASKS][12];	// [mask][bass]
+		int shapes[NUM_CHORDS];	// pitch classes above the root
+
+		ChordTables();
+	};
+
+	static const ChordTables *getChordTables();
+
+	const ChordTables *chordTables = getChordTables();
+
+	/*
+	 * Look up held notes, bit n of mask is pitch class n (C = 0) and bass is the pitch class of the
+	 * lowest note. Returns the ChordTable index, 0 if the notes are not a known chord. The inversion is
+	 * the number of chord tones between the root and the bass.
+	 */
+	int getChordFromMask(int mask, int bass, int *outRoot, int *outInversion) {
+		const ChordEntry &entry = chordTables->chords[mask & 0xfff][((bass % 12) + 12) % 12];
+		*outRoot = entry.root;
+		*outInversion = 0;
+		if (entry.chord == 0) {
+			return 0;
+		}
+		int above = ((bass - entry.root) % 12 + 12) % 12;
+		*outInversion = __builtin_popcount(chordTables->shapes[entry.chord] & ((1 << above) - 1));
+		return entry.chord;
+	}
 		
-	int ModeQuality[7][7] {
+	static constexpr int ModeQuality[7][7] {
 		{MAJ,MIN,MIN,MAJ,MAJ,MIN,DIM}, // Ionian
 		{MIN,MIN,MAJ,MAJ,MIN,DIM,MAJ}, // Dorian
 		{MIN,MAJ,MAJ,MIN,DIM,MAJ,MIN}, // Phrygian
@@ -477,7 +1057,7 @@ struct Core {
 		{DIM,MAJ,MIN,MIN,MAJ,MAJ,MIN}  // Locrian
 	};
 
-	int ModeOffset[7][7] {
+	static constexpr int ModeOffset[7][7] {
 		{0,0,0,0,0,0,0},     // Ionian
 		{0,0,-1,-1,0,0,-1},  // Dorian
 		{0,-1,-1,0,0,-1,-1}, // Phrygian
@@ -501,9 +1081,9 @@ struct Core {
 	// NOTE_B,
 
 	//0	1	2	3	4	5	6	7	8	9	10	11	12
-	int tonicIndex[13] {1, 3, 5, 0, 2, 4, 6, 1, 3, 5, 0, 2, 4};
-	int scaleIndex[7] {5, 3, 1, 6, 4, 2, 0};
-	int noteIndex[13] { 
+	static constexpr int tonicIndex[13] {1, 3, 5, 0, 2, 4, 6, 1, 3, 5, 0, 2, 4};
+	static constexpr int scaleIndex[7] {5, 3, 1, 6, 4, 2, 0};
+	static constexpr int noteIndex[13] { 
 		NOTE_G_FLAT,
 		NOTE_D_FLAT,
 		NOTE_A_FLAT,
@@ -520,5 +1100,3 @@ struct Core {
 			
 		
 };
-
-Core & CoreUtil();
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+
+/*
+ * Passes objects built on the UI thread (file loads, tables) to the engine thread without locks.
+ * The UI thread publishes, the engine thread picks the latest object up with acquire() and keeps
+ * using it until the next one arrives. Replaced objects are deleted by the UI thread on its next
+ * publish, so the engine thread never allocates or frees.
+ */
+template <typename T>
+struct Handover {
+
+	~Handover() {
+		delete pending.exchange(nullptr);
+		delete retired.exchange(nullptr);
+		delete current;
+	}
+
+	// UI thread
+	void publish(T *t) {
+		delete retired.exchange(nullptr);
+		delete pending.exchange(t);
+	}
+
+	// Engine thread, returns the object to use for this sample, NULL until something was published
+	T *acquire() {
+		T *p = pending.exchange(nullptr, std::memory_order_acquire);
+		if (p) {
+			T *old = current;
+			current = p;
+			// Only happens if two swaps ran between publishes on the UI thread
+			delete retired.exchange(old);
+		}
+		return current;
+	}
+
+	private:
+
+	std::atomic<T *> pending{nullptr};
+	std::atomic<T *> retired{nullptr};
+	T *current = nullptr;
+
+};
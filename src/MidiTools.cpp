@@ -0,0 +1,576 @@
+#include "MidiTools.hpp"
+
+#include <cstring>
+
+void MidiStats::reset() {
+	msgsIn.store(0);
+	msgsOut.store(0);
+	coalesced.store(0);
+	throttled.store(0);
+	echoes.store(0);
+	outDropped.store(0);
+	filtered.store(0);
+	inCoalesced.store(0);
+	inDeferred.store(0);
+	processCalls.store(0);
+	for (int k = 0; k < NUM_BUCKETS; k++) {
+		processTime[k].store(0);
+	}
+	inRate.store(0);
+	outRate.store(0);
+	inputBurst.store(0);
+	processMaxNs.store(0);
+	inQueueMax.store(0);
+	outQueueMax.store(0);
+	windowFrames = 0;
+	windowIn = 0;
+	windowOut = 0;
+	burst = 0;
+	slowest = 0;
+}
+
+void MidiStats::publish() {
+	uint64_t in = msgsIn.load(std::memory_order_relaxed);
+	uint64_t out = msgsOut.load(std::memory_order_relaxed);
+	inRate.store(in - windowIn, std::memory_order_relaxed);
+	outRate.store(out - windowOut, std::memory_order_relaxed);
+	inputBurst.store(burst, std::memory_order_relaxed);
+	processMaxNs.store(slowest, std::memory_order_relaxed);
+	windowIn = in;
+	windowOut = out;
+	windowFrames = 0;
+	burst = 0;
+	slowest = 0;
+}
+
+json_t *MidiStats::toJson() {
+	json_t *rootJ = json_object();
+
+	json_object_set_new(rootJ, "msgsIn", json_integer(msgsIn.load()));
+	json_object_set_new(rootJ, "msgsOut", json_integer(msgsOut.load()));
+	json_object_set_new(rootJ, "coalesced", json_integer(coalesced.load()));
+	json_object_set_new(rootJ, "throttled", json_integer(throttled.load()));
+	json_object_set_new(rootJ, "echoes", json_integer(echoes.load()));
+	json_object_set_new(rootJ, "outDropped", json_integer(outDropped.load()));
+	json_object_set_new(rootJ, "filtered", json_integer(filtered.load()));
+	json_object_set_new(rootJ, "inCoalesced", json_integer(inCoalesced.load()));
+	json_object_set_new(rootJ, "inDeferred", json_integer(inDeferred.load()));
+	json_object_set_new(rootJ, "inPerSecond", json_integer(inRate.load()));
+	json_object_set_new(rootJ, "outPerSecond", json_integer(outRate.load()));
+	json_object_set_new(rootJ, "inputBurstMax", json_integer(inputBurst.load()));
+	json_object_set_new(rootJ, "processCalls", json_integer(processCalls.load()));
+	json_object_set_new(rootJ, "processMaxNs", json_integer(processMaxNs.load()));
+	json_object_set_new(rootJ, "inQueueMax", json_integer(inQueueMax.load()));
+	json_object_set_new(rootJ, "outQueueMax", json_integer(outQueueMax.load()));
+
+	json_t *histogramJ = json_array();
+	for (int k = 0; k < NUM_BUCKETS; k++) {
+		json_t *bucketJ = json_object();
+		json_object_set_new(bucketJ, "belowNs", bucketLimit(k) ? json_integer(bucketLimit(k)) : json_null());
+		json_object_set_new(bucketJ, "count", json_integer(processTime[k].load()));
+		json_array_append_new(histogramJ, bucketJ);
+	}
+	json_object_set_new(rootJ, "processTime", histogramJ);
+
+	return rootJ;
+}
+
+std::vector<std::string> MidiStats::summary() {
+	std::vector<std::string> lines;
+
+	lines.push_back(string::f("In: %u msg/s (%llu total)", inRate.load(), (unsigned long long)msgsIn.load()));
+	lines.push_back(string::f("Out: %u msg/s (%llu total)", outRate.load(), (unsigned long long)msgsOut.load()));
+	lines.push_back(string::f("Coalesced: %llu, throttled: %llu", (unsigned long long)coalesced.load(), (unsigned long long)throttled.load()));
+	lines.push_back(string::f("Echoes suppressed: %llu", (unsigned long long)echoes.load()));
+	lines.push_back(string::f("Input burst: %u msgs", inputBurst.load()));
+	lines.push_back(string::f("Queue depth max: %u in, %u out", inQueueMax.load(), outQueueMax.load()));
+	lines.push_back(string::f("Output queue overflows: %llu", (unsigned long long)outDropped.load()));
+	lines.push_back(string::f("Input filtered: %llu", (unsigned long long)filtered.load()));
+	lines.push_back(string::f("Input coalesced: %llu, deferred blocks: %llu", (unsigned long long)inCoalesced.load(), (unsigned long long)inDeferred.load()));
+	lines.push_back(string::f("process() max: %.1f us", processMaxNs.load() / 1000.f));
+
+	uint64_t calls = processCalls.load();
+	if (calls > 0) {
+		for (int k = 0; k < NUM_BUCKETS; k++) {
+			uint64_t count = processTime[k].load();
+			if (count == 0) {
+				continue;
+			}
+			float percent = 100.f * count / calls;
+			if (bucketLimit(k)) {
+				lines.push_back(string::f("  < %lld ns: %.2f%%", (long long)bucketLimit(k), percent));
+			} else {
+				lines.push_back(string::f("  >= %lld ns: %.2f%%", (long long)bucketLimit(k - 1), percent));
+			}
+		}
+	}
+
+	return lines;
+}
+
+void TraceBuffer::start() {
+	if (!events) {
+		// Allocated once, before the first start request, and never freed while the module lives
+		events.reset(new Event[CAPACITY]);
+	}
+	request(true);
+}
+
+bool TraceBuffer::waitAcknowledged(float timeout) {
+	for (float waited = 0.f; waited < timeout; waited += 0.001f) {
+		if (acknowledged.load(std::memory_order_acquire) == requested.load(std::memory_order_relaxed)) {
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return false;
+}
+
+bool TraceBuffer::exportChrome(const std::string &filename, const char *const *names, int numNames) {
+	// Only read the ring once the engine has stopped writing to it
+	if (!events || (requested.load(std::memory_order_relaxed) & RUN) || !waitAcknowledged()) {
+		return false;
+	}
+
+	FILE *traceFile = fopen(filename.c_str(), "w");
+	if (!traceFile) {
+		return false;
+	}
+
+	uint32_t end = head.load(std::memory_order_acquire);
+	uint32_t begin = end > CAPACITY ? end - CAPACITY : 0;
+
+	fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", traceFile);
+	fputs("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"Rack engine\"}}", traceFile);
+
+	int64_t origin = end > begin ? events[begin % CAPACITY].start : 0;
+	for (uint32_t i = begin; i < end; i++) {
+		const Event &e = events[i % CAPACITY];
+		origin = std::min(origin, e.start);
+	}
+	for (uint32_t i = begin; i < end; i++) {
+		const Event &e = events[i % CAPACITY];
+		const char *name = (e.section >= 0 && e.section < numNames) ? names[e.section] : "unknown";
+		fprintf(traceFile, ",\n{\"name\":\"%s\",\"cat\":\"nymphes\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+			name, (e.start - origin) / 1000.0, e.duration / 1000.0);
+	}
+
+	fputs("\n]}\n", traceFile);
+	fclose(traceFile);
+	return true;
+}
+
+static void putVarLen(std::vector<uint8_t> &out, uint32_t value) {
+	uint8_t buffer[5];
+	int n = 0;
+	do {
+		buffer[n++] = value & 0x7f;
+		value >>= 7;
+	} while (value);
+	while (n--) {
+		out.push_back(buffer[n] | (n ? 0x80 : 0x00));
+	}
+}
+
+static void putBigEndian(std::vector<uint8_t> &out, uint32_t value, int bytes) {
+	for (int i = bytes - 1; i >= 0; i--) {
+		out.push_back((value >> (8 * i)) & 0xff);
+	}
+}
+
+static void putTrackName(std::vector<uint8_t> &out, const std::string &name) {
+	out.push_back(0x00);
+	out.push_back(0xff);
+	out.push_back(0x03);
+	putVarLen(out, name.size());
+	out.insert(out.end(), name.begin(), name.end());
+}
+
+static const char *RECORDER_TRACK_NAMES[MidiRecorder::NUM_DIRECTIONS] = {"NymphesControl in", "NymphesControl out"};
+
+void MidiRecorder::start(const std::string &filename, float sampleRate) {
+	stop();
+
+	this->filename = filename;
+	this->sampleRate = sampleRate;
+	for (int d = 0; d < NUM_DIRECTIONS; d++) {
+		tracks[d].clear();
+		putTrackName(tracks[d], RECORDER_TRACK_NAMES[d]);
+		lastFrame[d] = -1;
+	}
+	firstFrame = -1;
+	overruns.store(0);
+	tail.store(head.load());
+
+	recording.store(true);
+	flusher = std::thread(&MidiRecorder::flushLoop, this);
+}
+
+void MidiRecorder::stop() {
+	if (!flusher.joinable()) {
+		return;
+	}
+	recording.store(false);
+	flusher.join();
+	drain();
+	write();
+}
+
+void MidiRecorder::flushLoop() {
+	while (recording.load()) {
+		drain();
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+}
+
+void MidiRecorder::drain() {
+	uint32_t h = head.load(std::memory_order_acquire);
+	uint32_t t = tail.load(std::memory_order_relaxed);
+
+	for (; t != h; t++) {
+		const Event &e = ring[t % CAPACITY];
+		if (firstFrame < 0) {
+			firstFrame = e.frame;
+		}
+		int64_t frame = std::max(e.frame - firstFrame, (int64_t)0);
+		std::vector<uint8_t> &track = tracks[e.direction];
+		int64_t last = std::max(lastFrame[e.direction], (int64_t)0);
+		// Messages popped late can carry a frame before the last one written
+		frame = std::max(frame, last);
+		putVarLen(track, frame - last);
+		lastFrame[e.direction] = frame;
+
+		if (e.bytes[0] >= 0xf0) {
+			// System messages can't appear bare in a file, escape them
+			track.push_back(0xf7);
+			putVarLen(track, e.size);
+		}
+		track.insert(track.end(), e.bytes, e.bytes + e.size);
+	}
+
+	tail.store(t, std::memory_order_release);
+}
+
+void MidiRecorder::write() {
+	// One tick per sample: ticks per quarter is the sample rate divided down until it fits in 15 bits,
+	// and the tempo is set to match
+	int divider = 1;
+	while (sampleRate / divider > 0x7fff) {
+		divider *= 2;
+	}
+	uint32_t ppq = std::round(sampleRate / divider);
+	uint32_t tempo = std::round(1e6 * ppq / sampleRate);
+
+	std::vector<uint8_t> out;
+	out.insert(out.end(), {'M', 'T', 'h', 'd'});
+	putBigEndian(out, 6, 4);
+	putBigEndian(out, 1, 2); // format 1
+	putBigEndian(out, 1 + NUM_DIRECTIONS, 2);
+	putBigEndian(out, ppq, 2);
+
+	std::vector<uint8_t> conductor;
+	conductor.insert(conductor.end(), {0x00, 0xff, 0x51, 0x03});
+	putBigEndian(conductor, tempo, 3);
+
+	std::vector<uint8_t> *chunks[1 + NUM_DIRECTIONS] = {&conductor, &tracks[IN], &tracks[OUT]};
+	for (std::vector<uint8_t> *chunk : chunks) {
+		chunk->insert(chunk->end(), {0x00, 0xff, 0x2f, 0x00});
+		out.insert(out.end(), {'M', 'T', 'r', 'k'});
+		putBigEndian(out, chunk->size(), 4);
+		out.insert(out.end(), chunk->begin(), chunk->end());
+	}
+
+	FILE *midiFile = fopen(filename.c_str(), "wb");
+	if (!midiFile) {
+		return;
+	}
+	fwrite(out.data(), 1, out.size(), midiFile);
+	fclose(midiFile);
+}
+
+MidiReplay *MidiReplay::load(const std::string &filename, float sampleRate) {
+
+	FILE *midiFile = fopen(filename.c_str(), "rb");
+	if (!midiFile) {
+		return NULL;
+	}
+	std::vector<uint8_t> data;
+	uint8_t buffer[4096];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), midiFile)) > 0) {
+		data.insert(data.end(), buffer, buffer + n);
+	}
+	fclose(midiFile);
+
+	size_t pos = 0;
+	auto readBig = [&](int bytes, uint32_t *value) {
+		if (pos + bytes > data.size()) {
+			return false;
+		}
+		*value = 0;
+		for (int i = 0; i < bytes; i++) {
+			*value = (*value << 8) | data[pos++];
+		}
+		return true;
+	};
+
+	uint32_t chunkLength, format, numTracks, division;
+	if (data.size() < 14 || memcmp(data.data(), "MThd", 4) != 0) {
+		return NULL;
+	}
+	pos = 4;
+	readBig(4, &chunkLength);
+	readBig(2, &format);
+	readBig(2, &numTracks);
+	readBig(2, &division);
+	pos = 8 + chunkLength;
+	if (format > 1 || (division & 0x8000) || division == 0) {
+		// SMPTE time and format 2 sequences are not supported
+		return NULL;
+	}
+
+	struct TimedEvent {
+		uint64_t tick;
+		Event event;
+	};
+	std::vector<TimedEvent> timed;
+	// Tempo changes as (tick, microseconds per quarter), from any track
+	std::vector<std::pair<uint64_t, uint32_t>> tempos;
+
+	for (uint32_t track = 0; track < numTracks; track++) {
+		uint32_t trackLength;
+		if (pos + 8 > data.size()) {
+			break;
+		}
+		bool isTrack = memcmp(&data[pos], "MTrk", 4) == 0;
+		pos += 4;
+		readBig(4, &trackLength);
+		size_t end = std::min(pos + trackLength, data.size());
+		if (!isTrack) {
+			pos = end;
+			continue;
+		}
+
+		size_t firstEvent = timed.size();
+		bool outgoing = false;
+		uint64_t tick = 0;
+		uint8_t running = 0;
+
+		auto readVarLen = [&](uint32_t *value) {
+			*value = 0;
+			for (int i = 0; i < 4 && pos < end; i++) {
+				uint8_t b = data[pos++];
+				*value = (*value << 7) | (b & 0x7f);
+				if (!(b & 0x80)) {
+					return true;
+				}
+			}
+			return false;
+		};
+
+		while (pos < end) {
+			uint32_t delta;
+			if (!readVarLen(&delta)) {
+				break;
+			}
+			tick += delta;
+			if (pos >= end) {
+				break;
+			}
+
+			uint8_t status = data[pos];
+			if (status == 0xff) {
+				// Meta event
+				if (pos + 2 > end) {
+					break;
+				}
+				uint8_t type = data[pos + 1];
+				pos += 2;
+				uint32_t length;
+				if (!readVarLen(&length) || pos + length > end) {
+					break;
+				}
+				if (type == 0x51 && length == 3) {
+					tempos.push_back(std::make_pair(tick, (uint32_t)((data[pos] << 16) | (data[pos + 1] << 8) | data[pos + 2])));
+				}
+				if (type == 0x03 && std::string((const char *)&data[pos], length) == RECORDER_TRACK_NAMES[MidiRecorder::OUT]) {
+					outgoing = true;
+				}
+				pos += length;
+			} else if (status == 0xf0 || status == 0xf7) {
+				// Sysex or escaped bytes, only single system messages are kept
+				pos++;
+				uint32_t length;
+				if (!readVarLen(&length) || pos + length > end) {
+					break;
+				}
+				if (status == 0xf7 && length == 1 && data[pos] >= 0xf8) {
+					TimedEvent t = {tick, {0, {data[pos], 0, 0}, 1}};
+					timed.push_back(t);
+				}
+				pos += length;
+			} else {
+				if (status & 0x80) {
+					running = status;
+					pos++;
+				} else if (!running) {
+					break;
+				}
+				int size = ((running >> 4) == 0xc || (running >> 4) == 0xd) ? 2 : 3;
+				if (pos + size - 1 > end) {
+					break;
+				}
+				TimedEvent t = {tick, {0, {running, 0, 0}, (uint8_t)size}};
+				for (int i = 1; i < size; i++) {
+					t.event.bytes[i] = data[pos++] & 0x7f;
+				}
+				timed.push_back(t);
+			}
+		}
+
+		if (outgoing) {
+			timed.resize(firstEvent);
+		}
+		pos = end;
+	}
+
+	std::stable_sort(timed.begin(), timed.end(), [](const TimedEvent &a, const TimedEvent &b) {
+		return a.tick < b.tick;
+	});
+	std::stable_sort(tempos.begin(), tempos.end());
+
+	// Walk the tempo map alongside the events to convert ticks to frames
+	MidiReplay *replay = new MidiReplay;
+	replay->events.reserve(timed.size());
+	double seconds = 0.0;
+	uint64_t lastTick = 0;
+	uint32_t tempo = 500000;
+	size_t nextTempo = 0;
+	for (TimedEvent &t : timed) {
+		while (nextTempo < tempos.size() && tempos[nextTempo].first <= t.tick) {
+			seconds += (tempos[nextTempo].first - lastTick) * tempo * 1e-6 / division;
+			lastTick = tempos[nextTempo].first;
+			tempo = tempos[nextTempo].second;
+			nextTempo++;
+		}
+		seconds += (t.tick - lastTick) * tempo * 1e-6 / division;
+		lastTick = t.tick;
+		t.event.frame = std::llround(seconds * sampleRate);
+		replay->events.push_back(t.event);
+	}
+
+	return replay;
+}
+
+json_t *MidiRemap::toJson() const {
+	json_t *rootJ = json_array();
+	for (int c = 0; c < 16; c++) {
+		for (int cc = 0; cc < 128; cc++) {
+			const Entry &e = table[c][cc];
+			if (e.target < 0) {
+				continue;
+			}
+			json_t *entryJ = json_array();
+			json_array_append_new(entryJ, json_integer(c));
+			json_array_append_new(entryJ, json_integer(cc));
+			json_array_append_new(entryJ, json_integer(e.target));
+			json_array_append_new(entryJ, json_integer(e.min));
+			json_array_append_new(entryJ, json_integer(e.max));
+			json_array_append_new(rootJ, entryJ);
+		}
+	}
+	return rootJ;
+}
+
+void MidiRemap::fromJson(json_t *rootJ) {
+	clear();
+	for (size_t i = 0; i < json_array_size(rootJ); i++) {
+		json_t *entryJ = json_array_get(rootJ, i);
+		if (json_array_size(entryJ) != 5) {
+			continue;
+		}
+		int values[5];
+		for (int k = 0; k < 5; k++) {
+			values[k] = json_integer_value(json_array_get(entryJ, k));
+		}
+		set(values[0], values[1], values[2], clamp(values[3], 0, 127), clamp(values[4], 0, 127));
+	}
+}
+
+void VoiceAllocator::reset() {
+	for (int list : {FREE, BUSY}) {
+		next[list] = prev[list] = list;
+	}
+	for (int v = 0; v < NUM_VOICES; v++) {
+		note[v] = -1;
+		holds[v] = 0;
+		append(FREE, v);
+	}
+	freeMask = (1 << NUM_VOICES) - 1;
+	for (int n = 0; n < 128; n++) {
+		lastVoice[n] = -1;
+	}
+}
+
+int VoiceAllocator::allocate(int n, int *stolen) {
+	*stolen = -1;
+	int voice = lastVoice[n];
+	if (voice >= 0 && note[voice] == n) {
+		holds[voice]++;
+		return voice;
+	}
+	if (!freeMask) {
+		voice = steal(n);
+		if (voice < 0) {
+			return -1;
+		}
+		*stolen = note[voice];
+	} else if (mode == REUSE && voice >= 0 && (freeMask >> voice & 1)) {
+		// voice is still the last one to play n
+	} else {
+		voice = next[FREE];
+	}
+	unlink(voice);
+	append(BUSY, voice);
+	freeMask &= ~(1 << voice);
+	note[voice] = n;
+	holds[voice] = 1;
+	lastVoice[n] = voice;
+	return voice;
+}
+
+int VoiceAllocator::steal(int n) {
+	if (mode != LOWEST) {
+		return next[BUSY];
+	}
+	int highest = next[BUSY];
+	for (int v = next[highest]; v != BUSY; v = next[v]) {
+		if (note[v] > note[highest]) {
+			highest = v;
+		}
+	}
+	return n < note[highest] ? highest : -1;
+}
+
+bool VoiceAllocator::release(int voice) {
+	if (note[voice] < 0 || --holds[voice] > 0) {
+		return false;
+	}
+	unlink(voice);
+	append(FREE, voice);
+	freeMask |= 1 << voice;
+	note[voice] = -1;
+	return true;
+}
+
+void VoiceAllocator::unlink(int voice) {
+	next[prev[voice]] = next[voice];
+	prev[next[voice]] = prev[voice];
+}
+
+void VoiceAllocator::append(int list, int voice) {
+	prev[voice] = prev[list];
+	next[voice] = list;
+	next[prev[list]] = voice;
+	prev[list] = voice;
+}
@@ -0,0 +1,787 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "Skylander.hpp"
+
+/*
+ * Always-on counters for the MIDI traffic of a module and the cost of its process() call.
+ * Counters are bumped with add() from the engine thread and from the MIDI driver threads of the
+ * input queues, so they are atomic read-modify-writes. The UI thread only reads them, and clears
+ * them by asking the engine with requestReset().
+ */
+struct MidiStats {
+
+	// process() time histogram, bucket k counts calls shorter than 2^(k+6) ns that did not fit bucket k-1;
+	// the last bucket is open ended
+	static const int NUM_BUCKETS = 16;
+	static const int BUCKET_SHIFT = 6;
+
+	std::atomic<uint64_t> msgsIn{0};
+	std::atomic<uint64_t> msgsOut{0};
+	std::atomic<uint64_t> coalesced{0}; // CCs not sent because the synth already has that value
+	std::atomic<uint64_t> throttled{0}; // CC changes dropped by the output rate limiter
+	std::atomic<uint64_t> echoes{0}; // incoming CCs dropped as echoes of our own output
+	std::atomic<uint64_t> outDropped{0}; // outgoing messages lost because the output queue was full
+	std::atomic<uint64_t> filtered{0}; // incoming messages dropped by the input filter, written by the driver thread
+	std::atomic<uint64_t> inCoalesced{0}; // incoming CCs replaced by a later value in the same block
+	std::atomic<uint64_t> inDeferred{0}; // process() calls that left input queued after using up their budget
+	std::atomic<uint64_t> processCalls{0};
+	std::atomic<uint64_t> processTime[NUM_BUCKETS];
+
+	// Published once a second
+	std::atomic<uint32_t> inRate{0};
+	std::atomic<uint32_t> outRate{0};
+	std::atomic<uint32_t> inputBurst{0}; // most messages drained by a single process() call
+	std::atomic<uint32_t> processMaxNs{0};
+
+	// Deepest the input and output queues have been since the last reset, engine thread
+	std::atomic<uint32_t> inQueueMax{0};
+	std::atomic<uint32_t> outQueueMax{0};
+
+	MidiStats() {
+		reset();
+	}
+
+	// UI thread, the engine clears the counters at the end of its next process()
+	void requestReset() {
+		resetRequested.store(true, std::memory_order_release);
+	}
+
+	static void add(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+		counter.fetch_add(n, std::memory_order_relaxed);
+	}
+
+	// Engine thread
+	static void watermark(std::atomic<uint32_t> &mark, uint32_t depth) {
+		if (depth > mark.load(std::memory_order_relaxed)) {
+			mark.store(depth, std::memory_order_relaxed);
+		}
+	}
+
+	static int64_t now() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	void countIn(uint32_t n) {
+		if (n > 0) {
+			add(msgsIn, n);
+			if (n > burst) {
+				burst = n;
+			}
+		}
+	}
+
+	/*
+	 * Called at the end of every process() with the time it started, rolls the per second window.
+	 */
+	void endProcess(int64_t start, float sampleRate) {
+		int64_t ns = now() - start;
+		add(processTime[bucket(ns)]);
+		add(processCalls);
+		if (ns > slowest) {
+			slowest = ns;
+		}
+		if (++windowFrames >= sampleRate) {
+			publish();
+		}
+		if (resetRequested.load(std::memory_order_relaxed) && resetRequested.exchange(false, std::memory_order_acquire)) {
+			reset();
+		}
+	}
+
+	static int bucket(int64_t ns) {
+		if (ns < (1 << BUCKET_SHIFT)) {
+			return 0;
+		}
+		int log2 = 63 - __builtin_clzll((uint64_t)ns);
+		return clamp(log2 - BUCKET_SHIFT + 1, 0, NUM_BUCKETS - 1);
+	}
+
+	/*
+	 * Upper bound of a histogram bucket in ns, 0 for the open ended last one.
+	 */
+	static int64_t bucketLimit(int k) {
+		return k < NUM_BUCKETS - 1 ? (int64_t)1 << (k + BUCKET_SHIFT) : 0;
+	}
+
+	json_t *toJson();
+	std::vector<std::string> summary();
+
+	private:
+
+	std::atomic<bool> resetRequested{false};
+
+	// Engine thread only
+	int windowFrames = 0;
+	uint64_t windowIn = 0;
+	uint64_t windowOut = 0;
+	uint32_t burst = 0;
+	int64_t slowest = 0;
+
+	void reset();
+	void publish();
+
+};
+
+/*
+ * Input queue that drops unwanted messages in the driver callback, before they are queued, so
+ * clock, note and aftertouch floods from a shared device never reach the engine thread. Messages
+ * pass by status, with one bit per status nibble in statusMask, and CCs can be limited further to
+ * a whitelist. The settings are atomics read by the driver thread.
+ */
+struct FilteredInputQueue : midi::InputQueue {
+
+	std::atomic<uint32_t> statusMask{1 << 0xb | 1 << 0xc};
+	std::atomic<bool> ccWhitelistOnly{false};
+	// Drops go to stats->filtered from the driver thread, which several queues can share, so it is
+	// only ever changed with MidiStats::add and cleared by the engine
+	MidiStats *stats = NULL;
+
+	FilteredInputQueue() {
+		bool all[128];
+		std::fill(all, all + 128, true);
+		setCcWhitelist(all);
+	}
+
+	void setCcWhitelist(const bool allowed[128]) {
+		for (int k = 0; k < 2; k++) {
+			uint64_t bits = 0;
+			for (int i = 0; i < 64; i++) {
+				if (allowed[64 * k + i]) {
+					bits |= (uint64_t) 1 << i;
+				}
+			}
+			ccWhitelist[k].store(bits, std::memory_order_relaxed);
+		}
+	}
+
+	bool accepts(const midi::Message &message) const {
+		uint8_t status = message.getStatus();
+		if (!(statusMask.load(std::memory_order_relaxed) >> status & 1)) {
+			return false;
+		}
+		if (status == 0xb && ccWhitelistOnly.load(std::memory_order_relaxed)) {
+			uint8_t cc = message.getNote() & 0x7f;
+			return ccWhitelist[cc >> 6].load(std::memory_order_relaxed) >> (cc & 63) & 1;
+		}
+		return true;
+	}
+
+	void onMessage(const midi::Message &message) override {
+		if (!accepts(message)) {
+			if (stats) MidiStats::add(stats->filtered);
+			return;
+		}
+		midi::InputQueue::onMessage(message);
+	}
+
+	private:
+
+	std::atomic<uint64_t> ccWhitelist[2];
+
+};
+
+/*
+ * Paces outgoing messages at the rate of a DIN MIDI cable, so a burst of CCs waits here, where notes
+ * can still overtake it, instead of in the driver. Notes and sustain go in the high priority FIFO
+ * and always leave first. Everything else keeps its order in the low priority FIFO, where a CC that
+ * is still waiting on the same channel is updated in place, so it only ever carries its latest value.
+ * Bank select (CC 0 and 32) always queues, so it stays right before its program change. Engine
+ * thread only.
+ */
+struct MidiOutputQueue {
+
+	static const int BYTES_PER_SECOND = 3125;
+	static const uint32_t CAPACITY = 256;
+
+	MidiOutputQueue() {
+		clear();
+	}
+
+	void clear() {
+		highHead = highTail = lowHead = lowTail = 0;
+		credit = 0.f;
+		for (int key = 0; key < NUM_KEYS; key++) {
+			ccQueued[key] = 0;
+		}
+	}
+
+	bool empty() const {
+		return highHead == highTail && lowHead == lowTail;
+	}
+
+	uint32_t size() const {
+		return highHead - highTail + lowHead - lowTail;
+	}
+
+	bool pushHigh(const midi::Message &m) {
+		if (highHead - highTail == CAPACITY) {
+			return false;
+		}
+		high[highHead++ % CAPACITY] = m;
+		return true;
+	}
+
+	/*
+	 * Queue n messages that must leave back to back, all or none.
+	 */
+	bool pushHigh(const midi::Message *m, int n) {
+		if (highHead - highTail + n > CAPACITY) {
+			return false;
+		}
+		for (int i = 0; i < n; i++) {
+			high[highHead++ % CAPACITY] = m[i];
+		}
+		return true;
+	}
+
+	bool pushLow(const midi::Message &m) {
+		int key = -1;
+		if (m.getStatus() == 0xb && (m.getNote() & 0x7f) != 0 && (m.getNote() & 0x7f) != 32) {
+			key = m.getChannel() << 7 | (m.getNote() & 0x7f);
+			// The position is only a hint, it goes stale once its message has left and the FIFO wrapped
+			uint32_t queued = ccQueued[key];
+			midi::Message &q = low[queued % CAPACITY];
+			if (queued - lowTail < lowHead - lowTail && q.bytes[0] == m.bytes[0] && q.bytes[1] == m.bytes[1]) {
+				q = m;
+				return true;
+			}
+		}
+		if (lowHead - lowTail == CAPACITY) {
+			return false;
+		}
+		if (key >= 0) {
+			ccQueued[key] = lowHead;
+		}
+		low[lowHead++ % CAPACITY] = m;
+		return true;
+	}
+
+	/*
+	 * Called every sample, passes the messages that fit on the wire by now to send.
+	 */
+	template <typename F>
+	void process(float sampleTime, F send) {
+		credit = std::min(credit + BYTES_PER_SECOND * sampleTime, 1.f);
+		while (credit > 0.f && !empty()) {
+			const midi::Message &m = highHead != highTail ? high[highTail++ % CAPACITY] : low[lowTail++ % CAPACITY];
+			credit -= m.getSize();
+			send(m);
+		}
+	}
+
+	private:
+
+	static const int NUM_KEYS = 16 * 128;
+
+	midi::Message high[CAPACITY];
+	midi::Message low[CAPACITY];
+	uint32_t highHead, highTail;
+	uint32_t lowHead, lowTail;
+	uint32_t ccQueued[NUM_KEYS]; // low FIFO position of the last message queued for each CC on each channel
+	float credit; // bytes that may go out now, negative while the last message is still on the wire
+
+};
+
+/*
+ * Fixed pool of synth voices for turning gates into notes. Free voices are kept in release order
+ * and busy ones in allocation order, as two doubly linked lists through the same links, so taking,
+ * stealing and freeing a voice are all O(1), apart from the look through the busy voices for the
+ * highest note in LOWEST mode. A note that is already playing is shared by counting
+ * its holds instead of taking a second voice. Engine thread only.
+ */
+struct VoiceAllocator {
+
+	static const int NUM_VOICES = 6;
+
+	enum Mode {
+		ROUND_ROBIN, // the voice that has been free the longest, the oldest note is stolen
+		LOWEST, // like round robin, but when all are busy the highest note is stolen for a lower one, a higher one gets no voice
+		REUSE, // the voice that last played the same note if it is free, otherwise round robin
+		NUM_MODES
+	};
+
+	int mode = ROUND_ROBIN;
+	int note[NUM_VOICES]; // -1 while free
+	int holds[NUM_VOICES]; // gates holding each voice
+
+	VoiceAllocator() {
+		reset();
+	}
+
+	void reset();
+
+	/*
+	 * Take a voice for note, or add a hold to the voice already playing it. When a voice is stolen
+	 * the note it was playing goes to stolen, otherwise stolen is -1. Returns -1 if the note gets no
+	 * voice.
+	 */
+	int allocate(int note, int *stolen);
+	/*
+	 * Drop one hold of voice, true if that freed it.
+	 */
+	bool release(int voice);
+
+	private:
+
+	static const int FREE = NUM_VOICES;
+	static const int BUSY = NUM_VOICES + 1;
+
+	int next[NUM_VOICES + 2];
+	int prev[NUM_VOICES + 2];
+	uint32_t freeMask;
+	int8_t lastVoice[128];
+
+	int steal(int note);
+	void unlink(int voice);
+	void append(int list, int voice);
+
+};
+
+/*
+ * Collects the CCs drained in one block so only the latest value of each CC on each channel is
+ * applied. Bank select (CC 0 and 32) is never merged, it only means something right before its
+ * program change, so callers flush and pass it straight through along with every other
+ * message that isn't a CC. Engine thread only.
+ */
+struct CcCoalescer {
+
+	static bool mergeable(const midi::Message &msg) {
+		if (msg.getStatus() != 0xb) {
+			return false;
+		}
+		uint8_t cc = msg.getNote() & 0x7f;
+		return cc != 0 && cc != 32;
+	}
+
+	/*
+	 * Return true if msg replaced an earlier value of the same CC on the same channel.
+	 */
+	bool add(const midi::Message &msg) {
+		uint16_t key = msg.getChannel() << 7 | (msg.getNote() & 0x7f);
+		latest[key] = msg;
+		if (pending[key]) {
+			return true;
+		}
+		pending[key] = true;
+		order[count++] = key;
+		return false;
+	}
+
+	/*
+	 * Pass the surviving messages to apply, in the order their CCs first arrived.
+	 */
+	template <typename F>
+	void flush(F apply) {
+		for (int i = 0; i < count; i++) {
+			pending[order[i]] = false;
+			apply(latest[order[i]]);
+		}
+		count = 0;
+	}
+
+	private:
+
+	static const int NUM_KEYS = 16 * 128;
+
+	midi::Message latest[NUM_KEYS];
+	bool pending[NUM_KEYS] = {};
+	uint16_t order[NUM_KEYS];
+	int count = 0;
+
+};
+
+/*
+ * Remembers the last few values sent on each CC of each channel so the same values coming back, from
+ * a synth that echoes its input or from a MIDI thru path, can be dropped instead of being fed back
+ * into the controls. Engine thread only.
+ */
+struct EchoFilter {
+
+	static const int SLOTS = 4;
+
+	struct Sent {
+		int64_t frame;
+		int value;
+	};
+
+	bool enabled = true;
+	int64_t window = 0; // frames
+
+	EchoFilter() {
+		reset();
+	}
+
+	void reset() {
+		for (int key = 0; key < NUM_KEYS; key++) {
+			for (int k = 0; k < SLOTS; k++) {
+				sent[key][k].value = -1;
+			}
+			next[key] = 0;
+		}
+	}
+
+	void remember(int channel, int cc, int value, int64_t frame) {
+		int key = (channel & 0xf) << 7 | (cc & 0x7f);
+		Sent &s = sent[key][next[key]++ % SLOTS];
+		s.frame = frame;
+		s.value = value;
+	}
+
+	/*
+	 * True if value was sent on cc of channel within the window. A match is used up, so an echo is
+	 * only dropped once and a later move to the same value still gets through.
+	 */
+	bool match(int channel, int cc, int value, int64_t frame) {
+		if (!enabled) {
+			return false;
+		}
+		int key = (channel & 0xf) << 7 | (cc & 0x7f);
+		for (int k = 0; k < SLOTS; k++) {
+			Sent &s = sent[key][k];
+			if (s.value == value && std::abs(frame - s.frame) <= window) {
+				s.value = -1;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	private:
+
+	static const int NUM_KEYS = 16 * 128;
+
+	Sent sent[NUM_KEYS][SLOTS];
+	uint8_t next[NUM_KEYS];
+
+};
+
+/*
+ * Fixed size, lock-free single producer ring of timed sections. The engine thread writes complete
+ * events through TraceScope while a capture is running; the UI thread exports them afterwards as a
+ * Chrome/Perfetto trace. The buffer is only allocated by the first capture, and a capture that is
+ * not running costs one relaxed load and a branch per scope.
+ *
+ * The UI only requests a start or stop. The engine applies it in poll() at the top of process(),
+ * where no scope is open, so head and enabled have the engine as their only writer and an export
+ * that has seen its stop acknowledged reads a ring nobody is writing.
+ */
+struct TraceBuffer {
+
+	static const uint32_t CAPACITY = 1 << 16;
+
+	struct Event {
+		int64_t start;
+		int32_t duration;
+		int32_t section;
+	};
+
+	std::atomic<bool> enabled{false};
+	std::atomic<uint32_t> head{0};
+
+	void record(int section, int64_t start, int64_t end) {
+		uint32_t h = head.load(std::memory_order_relaxed);
+		Event &e = events[h % CAPACITY];
+		e.start = start;
+		e.duration = (int32_t)(end - start);
+		e.section = section;
+		head.store(h + 1, std::memory_order_release);
+	}
+
+	// Engine thread, before any TraceScope of the current process()
+	void poll() {
+		uint32_t r = requested.load(std::memory_order_acquire);
+		if (r == acknowledged.load(std::memory_order_relaxed)) {
+			return;
+		}
+		if (r & RUN) {
+			head.store(0, std::memory_order_relaxed);
+		}
+		enabled.store(r & RUN, std::memory_order_relaxed);
+		acknowledged.store(r, std::memory_order_release);
+	}
+
+	// UI thread
+	void start();
+	void stop() {
+		request(false);
+	}
+	uint32_t size() {
+		return std::min(head.load(std::memory_order_acquire), CAPACITY);
+	}
+
+	/*
+	 * Wait up to timeout seconds for the engine to apply the last request. False if it didn't,
+	 * for example while the module is bypassed.
+	 */
+	bool waitAcknowledged(float timeout = 0.5f);
+
+	/*
+	 * Write the last capture as Chrome trace event JSON, one complete ("X") event per section.
+	 * names holds the display name of each section id. Returns false if the file can't be written.
+	 */
+	bool exportChrome(const std::string &filename, const char *const *names, int numNames);
+
+	private:
+
+	// Requests count up in steps of 2, the low bit says whether the capture should run
+	static const uint32_t RUN = 1;
+
+	std::unique_ptr<Event[]> events;
+	std::atomic<uint32_t> requested{0};
+	std::atomic<uint32_t> acknowledged{0};
+
+	void request(bool run) {
+		uint32_t r = requested.load(std::memory_order_relaxed);
+		requested.store(((r & ~RUN) + 2) | (run ? RUN : 0), std::memory_order_release);
+	}
+
+};
+
+struct TraceScope {
+
+	TraceBuffer &trace;
+	int section;
+	int64_t start = 0;
+
+	TraceScope(TraceBuffer &trace, int section) : trace(trace), section(section) {
+		if (trace.enabled.load(std::memory_order_acquire)) {
+			start = MidiStats::now();
+		}
+	}
+
+	~TraceScope() {
+		// Sections that began before the capture started are dropped rather than clipped
+		if (start && trace.enabled.load(std::memory_order_relaxed)) {
+			trace.record(section, start, MidiStats::now());
+		}
+	}
+
+};
+
+/*
+ * Captures the MIDI traffic of a module into a preallocated lock-free ring on the engine thread.
+ * A background thread drains the ring while recording and writes a Standard MIDI File on stop,
+ * with one track for incoming and one for outgoing messages. Ticks are exactly one sample long.
+ */
+struct MidiRecorder {
+
+	enum Direction {
+		IN,
+		OUT,
+		NUM_DIRECTIONS
+	};
+
+	static const uint32_t CAPACITY = 1 << 14;
+
+	struct Event {
+		int64_t frame;
+		uint8_t bytes[3];
+		uint8_t size;
+		uint8_t direction;
+	};
+
+	std::atomic<bool> recording{false};
+	std::atomic<uint64_t> overruns{0}; // events lost because the flush thread fell behind
+
+	~MidiRecorder() {
+		stop();
+	}
+
+	// Engine thread
+	void push(const midi::Message &m, int direction, int64_t frame) {
+		if (!recording.load(std::memory_order_relaxed)) {
+			return;
+		}
+		uint32_t h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) >= CAPACITY) {
+			MidiStats::add(overruns);
+			return;
+		}
+		Event &e = ring[h % CAPACITY];
+		e.frame = frame;
+		e.size = std::min(m.getSize(), 3);
+		for (int i = 0; i < e.size; i++) {
+			e.bytes[i] = m.bytes[i];
+		}
+		e.direction = direction;
+		head.store(h + 1, std::memory_order_release);
+	}
+
+	// UI thread
+	void start(const std::string &filename, float sampleRate);
+	void stop();
+
+	private:
+
+	Event ring[CAPACITY];
+	std::atomic<uint32_t> head{0};
+	std::atomic<uint32_t> tail{0};
+
+	// Flush thread
+	std::thread flusher;
+	std::string filename;
+	float sampleRate = 44100.f;
+	std::vector<uint8_t> tracks[NUM_DIRECTIONS];
+	int64_t lastFrame[NUM_DIRECTIONS];
+	int64_t firstFrame = -1;
+
+	void flushLoop();
+	void drain();
+	void write();
+
+};
+
+/*
+ * Channel messages read back from a Standard MIDI File, with their time converted to frames at the
+ * engine sample rate. Tracks named as outgoing by MidiRecorder are left out, so a recording replays
+ * exactly what the module received.
+ */
+struct MidiReplay {
+
+	struct Event {
+		int64_t frame;
+		uint8_t bytes[3];
+		uint8_t size;
+	};
+
+	std::vector<Event> events;
+
+	// Engine thread
+	size_t cursor = 0;
+	int64_t position = 0;
+
+	/*
+	 * Parse a type 0 or 1 file, returns NULL if it is not a readable MIDI file.
+	 */
+	static MidiReplay *load(const std::string &filename, float sampleRate);
+
+	/*
+	 * Step one frame, calling onEvent for each message due. Returns false once the end is reached.
+	 */
+	template <typename F>
+	bool process(F onEvent) {
+		while (cursor < events.size() && events[cursor].frame <= position) {
+			onEvent(events[cursor]);
+			cursor++;
+		}
+		position++;
+		return cursor < events.size();
+	}
+
+	void rewind() {
+		cursor = 0;
+		position = 0;
+	}
+
+};
+
+/*
+ * CC remapping for an external controller. Any CC on any channel can drive one target, with its
+ * value scaled linearly from 0-127 to min-max (max below min inverts). The lookup is a direct
+ * 16 x 128 table, so every message costs the same.
+ *
+ * The table belongs to the engine thread. The UI thread changes it with post(), which queues the
+ * edit in a lock-free ring for the engine to apply in applyEdits().
+ */
+struct MidiRemap {
+
+	struct Entry {
+		int16_t target;
+		uint8_t min;
+		uint8_t max;
+	};
+
+	static const uint32_t EDIT_CAPACITY = 64;
+
+	Entry table[16][128];
+
+	MidiRemap() {
+		clear();
+	}
+
+	/*
+	 * UI thread. A channel of -1 clears every mapping. Returns false if the engine has fallen
+	 * EDIT_CAPACITY edits behind.
+	 */
+	bool post(int channel, int cc, int target, int min = 0, int max = 127) {
+		uint32_t h = editHead.load(std::memory_order_relaxed);
+		if (h - editTail.load(std::memory_order_acquire) >= EDIT_CAPACITY) {
+			return false;
+		}
+		Edit &e = edits[h % EDIT_CAPACITY];
+		e.channel = channel;
+		e.cc = cc;
+		e.entry.target = target;
+		e.entry.min = min;
+		e.entry.max = max;
+		editHead.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Engine thread
+	void applyEdits() {
+		uint32_t h = editHead.load(std::memory_order_acquire);
+		uint32_t t = editTail.load(std::memory_order_relaxed);
+		if (t == h) {
+			return;
+		}
+		for (; t != h; t++) {
+			const Edit &e = edits[t % EDIT_CAPACITY];
+			if (e.channel < 0) {
+				clear();
+			} else {
+				set(e.channel, e.cc, e.entry.target, e.entry.min, e.entry.max);
+			}
+		}
+		editTail.store(t, std::memory_order_release);
+	}
+
+	void clear() {
+		for (int c = 0; c < 16; c++) {
+			for (int cc = 0; cc < 128; cc++) {
+				set(c, cc, -1);
+			}
+		}
+	}
+
+	void set(int channel, int cc, int target, int min = 0, int max = 127) {
+		Entry &e = table[channel & 0xf][cc & 0x7f];
+		e.target = target;
+		e.min = min;
+		e.max = max;
+	}
+
+	/*
+	 * Target of a CC message, or -1 if it is not mapped. The scaled value goes to value.
+	 */
+	int map(const midi::Message &msg, int *value) const {
+		if (msg.getStatus() != 0xb) {
+			return -1;
+		}
+		const Entry &e = table[msg.getChannel()][msg.getNote() & 0x7f];
+		if (e.target >= 0) {
+			*value = e.min + ((int) e.max - e.min) * (msg.getValue() & 0x7f) / 127;
+		}
+		return e.target;
+	}
+
+	json_t *toJson() const;
+	void fromJson(json_t *rootJ);
+
+	private:
+
+	struct Edit {
+		int channel;
+		int cc;
+		Entry entry;
+	};
+
+	Edit edits[EDIT_CAPACITY];
+	std::atomic<uint32_t> editHead{0};
+	std::atomic<uint32_t> editTail{0};
+
+};
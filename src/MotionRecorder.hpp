@@ -0,0 +1,161 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+/*
+ * Motion sequencing of controller values over a loop of beats. Events are kept sorted by
+ * tick in a fixed size array and played back with a single cursor, so each control step only
+ * touches the events that are due. Recording overdubs: controllers moved during a pass replace
+ * their old events on the same page when the loop wraps.
+ */
+struct MotionRecorder {
+
+	static const int MAX_EVENTS = 8192;
+	static const int NUM_CONTROLLERS = 74;
+	static const int NUM_PAGES = 4;
+	static const int TICKS_PER_BEAT = 96; // divisible by every clock input resolution
+
+	struct Event {
+		uint32_t tick;
+		uint8_t controller;
+		uint8_t page; // mod source the value belongs to, for the switchable mod sliders
+		uint8_t value;
+	};
+
+	Event events[MAX_EVENTS];
+	int numEvents = 0;
+	int loopBeats = 16;
+	bool recording = false;
+	bool playing = false;
+
+	void clear() {
+		numEvents = 0;
+		numPending = 0;
+		cursor = 0;
+		clearTouched();
+	}
+
+	uint32_t loopTicks() const {
+		return loopBeats * TICKS_PER_BEAT;
+	}
+
+	/*
+	 * Change the loop length. Events past the end of a shorter loop would never play, so they are
+	 * dropped rather than left taking up room.
+	 */
+	void setLoopBeats(int beats) {
+		loopBeats = beats;
+		uint32_t end = loopTicks();
+		while (numEvents > 0 && events[numEvents - 1].tick >= end) {
+			numEvents--;
+		}
+		while (numPending > 0 && pending[numPending - 1].tick >= end) {
+			numPending--;
+		}
+		cursor = std::min(cursor, numEvents);
+	}
+
+	/*
+	 * Position in the loop for a clock of ppqn pulses per beat that has seen the given number of
+	 * pulses, phase through the current one.
+	 */
+	uint32_t tickAt(uint32_t pulses, float phase, int ppqn) const {
+		uint32_t pulse = pulses > 0 ? pulses - 1 : 0;
+		uint32_t beat = pulse / ppqn % loopBeats;
+		uint32_t ticksPerPulse = TICKS_PER_BEAT / ppqn;
+		return beat * TICKS_PER_BEAT + pulse % ppqn * ticksPerPulse + (uint32_t)(phase * ticksPerPulse);
+	}
+
+	void record(uint32_t tick, int controller, int page, int value) {
+		if (!recording || numPending == MAX_EVENTS) {
+			return;
+		}
+		touched[controller][page] = true;
+		Event &e = pending[numPending++];
+		e.tick = tick;
+		e.controller = controller;
+		e.page = page;
+		e.value = value;
+	}
+
+	/*
+	 * Move the loop to tick, calling apply(controller, page, value) for every event passed on the way.
+	 */
+	template <typename F>
+	void advance(uint32_t tick, F apply) {
+		if (tick < lastTick) {
+			play(loopTicks(), apply);
+			wrap();
+		}
+		play(tick, apply);
+		lastTick = tick;
+	}
+
+	private:
+
+	Event pending[MAX_EVENTS];
+	int numPending = 0;
+	bool touched[NUM_CONTROLLERS][NUM_PAGES] = {};
+	int cursor = 0;
+	uint32_t lastTick = 0;
+
+	template <typename F>
+	void play(uint32_t tick, F apply) {
+		for (; cursor < numEvents && events[cursor].tick <= tick; cursor++) {
+			const Event &e = events[cursor];
+			// While recording, the live moves win over what was there before
+			if (playing && !touched[e.controller][e.page]) {
+				apply(e.controller, e.page, e.value);
+			}
+		}
+	}
+
+	/*
+	 * Merge the pass just recorded into the loop, in place and in linear time.
+	 */
+	void wrap() {
+		cursor = 0;
+		if (numPending == 0) {
+			return;
+		}
+
+		int kept = 0;
+		for (int i = 0; i < numEvents; i++) {
+			if (!touched[events[i].controller][events[i].page]) {
+				events[kept++] = events[i];
+			}
+		}
+
+		int total = kept + numPending;
+		if (total > MAX_EVENTS) {
+			// Keep the oldest part of the new pass
+			numPending -= total - MAX_EVENTS;
+			total = MAX_EVENTS;
+		}
+
+		// Pending events were recorded in tick order, merge both sorted runs from the back
+		int i = kept - 1;
+		int j = numPending - 1;
+		for (int k = total - 1; j >= 0; k--) {
+			if (i >= 0 && events[i].tick > pending[j].tick) {
+				events[k] = events[i--];
+			} else {
+				events[k] = pending[j--];
+			}
+		}
+
+		numEvents = total;
+		numPending = 0;
+		clearTouched();
+	}
+
+	void clearTouched() {
+		for (int c = 0; c < NUM_CONTROLLERS; c++) {
+			for (int p = 0; p < NUM_PAGES; p++) {
+				touched[c][p] = false;
+			}
+		}
+	}
+
+};
@@ -1,5 +1,10 @@
 #include "Skylander.hpp"
 #include "UI.hpp"
+#include "NymphesPatch.hpp"
+#include "MidiTools.hpp"
+#include "Handover.hpp"
+#include "MotionRecorder.hpp"
+#include "Core.hpp"
 #include <climits>
 #include <cstdlib>
 #include <ctime>
@@ -12,6 +17,11 @@
 
 struct CCMidiOutput : midi::Output {
 	int lastValues[128];
+	MidiStats *stats = NULL;
+	MidiRecorder *recorder = NULL;
+	EchoFilter echoes;
+	MidiOutputQueue queue;
+	int64_t frame = 0;
 
 	CCMidiOutput() {
 		reset();
@@ -21,18 +31,22 @@ struct CCMidiOutput : midi::Output {
 		for (int n = 0; n < 128; n++) {
 			lastValues[n] = -1;
 		}
+		echoes.reset();
+		queue.clear();
 	}
 
 	void setValue(int value, int cc) {
-		if (value == lastValues[cc])
+		if (value == lastValues[cc]) {
+			if (stats) MidiStats::add(stats->coalesced);
 			return;
+		}
 		lastValues[cc] = value;
 		// CC
 		midi::Message m;
 		m.setStatus(0xb);
 		m.setNote(cc);
 		m.setValue(value);
-		sendMessage(m);
+		send(m);
 	}
 
 	void sendProgram(uint8_t program) {
@@ -41,6 +55,46 @@ struct CCMidiOutput : midi::Output {
 		m.setStatus(0xC);
 		m.setNote(program);
 		m.setValue(0x0);
+		send(m);
+	}
+
+	// Queued behind the CCs already waiting
+	void send(const midi::Message &m) {
+		if (!queue.pushLow(m) && stats) MidiStats::add(stats->outDropped);
+	}
+
+	// Overtakes everything sent with send()
+	void sendPriority(const midi::Message &m) {
+		if (!queue.pushHigh(m) && stats) MidiStats::add(stats->outDropped);
+	}
+
+	// Bank select and program change in one block that nothing can get between
+	void sendProgramGroup(const midi::Message *block) {
+		if (!queue.pushHigh(block, 3)) {
+			if (stats) MidiStats::add(stats->outDropped, 3);
+			return;
+		}
+		lastValues[0] = block[0].getValue();
+		lastValues[32] = block[1].getValue();
+	}
+
+	void process(float sampleTime) {
+		if (stats) MidiStats::watermark(stats->outQueueMax, queue.size());
+		queue.process(sampleTime, [&](const midi::Message &m) {
+			transmit(m);
+		});
+	}
+
+	void transmit(const midi::Message &m) {
+		if (stats) MidiStats::add(stats->msgsOut);
+		if (recorder) recorder->push(m, MidiRecorder::OUT, frame);
+		// CCs leave on the output channel whatever channel they were queued with
+		if (m.getStatus() == 0xb) echoes.remember(getChannel(), m.getNote(), m.getValue(), frame);
+		// Notes already carry their voice's channel, which sendMessage() would replace with ours
+		if (m.getStatus() == 0x8 || m.getStatus() == 0x9) {
+			if (outputDevice) outputDevice->sendMessage(m);
+			return;
+		}
 		sendMessage(m);
 	}
   
@@ -71,6 +125,10 @@ struct NymphesControl : Module {
 		ENUMS(CC_INPUTS, 74),
 		CV_PC,
 		CV_PC_SEND,
+		CLOCK_INPUT,
+		NOTE_VOCT_INPUT,
+		NOTE_GATE_INPUT,
+		NOTE_VELOCITY_INPUT,
 		NUM_INPUTS
 	};
 	enum OutputIds {
@@ -90,7 +148,25 @@ struct NymphesControl : Module {
 		NUM_LIGHTS
 	};
 
-	midi::InputQueue midiInput;
+	enum TraceSections {
+		TRACE_PROCESS,
+		TRACE_MIDI_POP,
+		TRACE_BUTTONS,
+		TRACE_MOD_FILTERS,
+		TRACE_CLOCK,
+		TRACE_NOTES,
+		TRACE_MOD_CONTROLLERS,
+		TRACE_CONTROLLERS,
+		TRACE_PROGRAM_CHANGE,
+		TRACE_FILES,
+		NUM_TRACE_SECTIONS
+	};
+
+	FilteredInputQueue midiInput;
+	FilteredInputQueue controllerInput;
+	FilteredInputQueue thruInput;
+	static const uint32_t INPUT_BUDGET = 16;
+	CcCoalescer inputCcs;
 	int8_t values_in[128];
 	int learnedCcs[82];
 	dsp::ExponentialFilter valueFilters[38];
@@ -109,6 +185,66 @@ struct NymphesControl : Module {
         int last_mod_value[4][36];
 
 	CCMidiOutput midiOutput;
+	MidiStats stats;
+	TraceBuffer trace;
+	MidiRecorder recorder;
+	Handover<MidiReplay> replay;
+	std::atomic<bool> replayLoop{false};
+	midi::Message replayMsg;
+
+	VoiceAllocator voices;
+	// Voice v plays on the channel v + 1 after the output channel, like an MPE lower zone
+	bool voiceChannels = false;
+	int voiceChannel[VoiceAllocator::NUM_VOICES]; // channel of the note each voice is playing
+	int channelVoice[16];
+	// Gate state per channel, a channel that lost its voice or got none stays silent until its gate falls
+	bool channelGate[16];
+	bool channelStolen[16];
+	midi::Message noteMsg;
+
+	// MIDI clock follows the clock input through a PLL, realtime messages skip the output queue
+	ClockPll clockOut;
+	bool sendClock = false;
+	static constexpr int CLOCK_PPQN[] = {1, 2, 4, 24};
+	int clockPpqn = 0; // index into CLOCK_PPQN, pulses per beat on the clock input
+	midi::Message clockMsg;
+	midi::Message startMsg;
+	midi::Message stopMsg;
+	ClockTracker clock;
+	MotionRecorder motion;
+	int motion_last[74];
+	int motion_page_last = 0;
+	std::atomic<bool> motionClear{false};
+	std::atomic<int> motionLoopBeats{0}; // loop length requested from the menu, 0 when none
+
+	enum HistoryRequest {
+		HISTORY_NONE,
+		HISTORY_UNDO,
+		HISTORY_REDO,
+		HISTORY_JUMP,
+		HISTORY_RESTART
+	};
+	NymphesPatchHistory history;
+	std::atomic<int> historyRequest{HISTORY_NONE};
+	std::atomic<uint32_t> historyTarget{0}; // step for HISTORY_JUMP, stored before the request
+	int historyCount = 0;
+	int historyIdle = 0;
+	// Soft takeover, indexed like learnedCcs: incoming values are ignored until the hardware knob
+	// crosses the module's value
+	bool softTakeover = false;
+	bool softTakeoverLast = false;
+	bool pickedUp[82];
+	int pickupLast[82];
+
+	// External controller remapping, targets are indexed like learnedCcs
+	enum RemapLearn {
+		REMAP_IDLE,
+		REMAP_WAIT_SLIDER,
+		REMAP_WAIT_CC
+	};
+	MidiRemap remap;
+	std::atomic<int> remapLearn{REMAP_IDLE};
+	int remapTarget = -1;
 	float rateLimiterPhase = 0.f;
         int value_out = 0;
         bool value_changed = false;
@@ -145,6 +281,24 @@ struct NymphesControl : Module {
         int pc_bank_last = 0;
         int program_change_last = 0;
         dsp::SchmittTrigger sendPCTrigger;
+
+	// Program changes can wait for the next beat or bar, ready to go as one block
+	enum ProgramChangeTiming {
+		PC_IMMEDIATE,
+		PC_NEXT_BEAT,
+		PC_NEXT_BAR
+	};
+	int pcTiming = PC_IMMEDIATE;
+	int beatsPerBar = 4;
+	midi::Message pcBlock[3];
+	bool pcPending = false;
+
+	// Random modulation per slider, added to the CC value when it is sent. Sample and hold follows
+	// the clock input when it is patched.
+	RandomModulators<74> randomMods;
+	int mod_offset_last[74];
+	bool randomModsClocked = false;
+	static constexpr float CONTROL_PERIOD = 0.0005f;
   
 	NymphesControl() {
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
@@ -181,6 +335,20 @@ struct NymphesControl : Module {
 		configParam(NymphesControl::PROGRAM_KNOB, 0.0, 48.0, 0.0, "");
 		configParam(NymphesControl::PROGRAM_SEND, 0.0, 1.0, 0.0, "");
 		
+		midiOutput.stats = &stats;
+		midiOutput.recorder = &recorder;
+		midiInput.stats = &stats;
+		midiInput.ccWhitelistOnly.store(true);
+		for (midi::Message* m : {&clockMsg, &startMsg, &stopMsg})
+			m->setSize(1);
+		clockMsg.bytes[0] = 0xf8;
+		startMsg.bytes[0] = 0xfa;
+		stopMsg.bytes[0] = 0xfc;
+		randomMods.rng.seed(random::u64());
+		controllerInput.stats = &stats;
+		controllerInput.statusMask.store(1 << 0xb);
+		thruInput.stats = &stats;
+		thruInput.statusMask.store(1 << 0x8 | 1 << 0x9 | 1 << 0xa | 1 << 0xb | 1 << 0xd | 1 << 0xe);
 		onReset();
 	}
 
@@ -204,7 +372,11 @@ struct NymphesControl : Module {
 		}
 		for (int i = 0; i < 74; i++) {
 		        cc_values_last[i] = -10;
+			mod_offset_last[i] = 0;
+			randomMods.mode[i] = RandomModulators<74>::OFF;
+			randomMods.depth[i] = 0.25f;
 		}
+		randomMods.rate = 1.f;
 		for (int i = 0; i < 4; i++) {
 		        for (int j = 0; j < 36; j++) {
 			  mod_valueFilters_last[i][j] = -10;
@@ -242,17 +414,148 @@ struct NymphesControl : Module {
 			// learnedCcs[i] = i;
 			learnedCcs[i] = nymphes_cc_map[i];
 		}
+		updateInputFilter();
 		mod_src = 0;
 		mod_src_last = 4;
+		resetPickup(8, 82);
+		for (int i = 0; i < 74; i++) {
+			motion_last[i] = -10;
+		}
+		motion.clear();
+		motion.recording = false;
+		motion.playing = false;
+		voices.reset();
+		for (int v = 0; v < VoiceAllocator::NUM_VOICES; v++) {
+			voiceChannel[v] = 0;
+		}
+		for (int c = 0; c < 16; c++) {
+			channelVoice[c] = -1;
+			channelGate[c] = false;
+			channelStolen[c] = false;
+		}
+		clock.reset();
+		clockOut.reset();
+		historyRequest.store(HISTORY_RESTART);
+		remap.clear();
+		remapLearn.store(REMAP_IDLE);
 		midiInput.reset();
+		controllerInput.reset();
+		thruInput.reset();
 		midiOutput.reset();
 	}
 
 	void process(const ProcessArgs& args) override {
+		trace.poll();
+		int64_t start = MidiStats::now();
+		midiOutput.frame = args.frame;
+		// Echoes from the synth or a thru path are expected well within 50ms
+		midiOutput.echoes.window = (int64_t)(args.sampleRate * 0.05f);
+		{
+			TraceScope scope(trace, TRACE_PROCESS);
+			processControls(args);
+			midiOutput.process(args.sampleTime);
+		}
+		stats.endProcess(start, args.sampleRate);
+	}
+
+	void processControls(const ProcessArgs& args) {
+		processMidiInput(args);
+		processButtons(args);
+		processModFilters(args);
+		processClock(args);
+		processNotes(args);
+
+		if (!rateLimiter(args)) {
+			return;
+		}
+
+		processMotion(args);
+		processRandomMods(args);
+		processModControllers(args);
+		processControllers(args);
+		processProgramChange(args);
+		processFiles(args);
+		processHistory(args);
+	}
+
+	void processMidiInput(const ProcessArgs& args) {
+		TraceScope scope(trace, TRACE_MIDI_POP);
+
+		// At most INPUT_BUDGET messages are taken per call, the rest stay queued for the next
+		// sample, so a dump or a runaway device can't make one call arbitrarily long
 		midi::Message msg;
-		while (midiInput.tryPop(&msg, args.frame)) {
-			processMessage(msg);
+		uint32_t popped = 0;
+		while (popped < INPUT_BUDGET && midiInput.tryPop(&msg, args.frame)) {
+			recorder.push(msg, MidiRecorder::IN, msg.frame);
+			if (CcCoalescer::mergeable(msg)) {
+				if (inputCcs.add(msg)) {
+					MidiStats::add(stats.inCoalesced);
+				}
+			} else {
+				// CCs that came before this message are applied before it, so bank select and
+				// program change keep their order
+				flushInputCcs();
+				processMessage(msg);
+			}
+			popped++;
+		}
+		flushInputCcs();
+		watermarkInput(midiInput, popped);
+
+		uint32_t before = popped;
+		remap.applyEdits();
+		while (popped < INPUT_BUDGET && controllerInput.tryPop(&msg, args.frame)) {
+			processControllerMessage(msg);
+			popped++;
+		}
+		watermarkInput(controllerInput, popped - before);
+
+		before = popped;
+		while (popped < INPUT_BUDGET && thruInput.tryPop(&msg, args.frame)) {
+			processThruMessage(msg);
+			popped++;
+		}
+		watermarkInput(thruInput, popped - before);
+		if (popped == INPUT_BUDGET && (midiInput.size() > 0 || controllerInput.size() > 0 || thruInput.size() > 0)) {
+			MidiStats::add(stats.inDeferred);
+		}
+
+		// Recorded traffic is fed in as if it came from the input port
+		MidiReplay* r = replay.acquire();
+		if (r) {
+			bool more = r->process([&](const MidiReplay::Event& e) {
+				replayMsg.setSize(e.size);
+				for (int i = 0; i < e.size; i++) {
+					replayMsg.bytes[i] = e.bytes[i];
+				}
+				replayMsg.frame = args.frame;
+				recorder.push(replayMsg, MidiRecorder::IN, args.frame);
+				processMessage(replayMsg);
+				popped++;
+			});
+			if (!more && replayLoop.load(std::memory_order_relaxed)) {
+				r->rewind();
+			}
 		}
+		stats.countIn(popped);
+	}
+
+	void flushInputCcs() {
+		inputCcs.flush([&](const midi::Message& m) {
+			processCC(m);
+		});
+	}
+
+	// Depth of a queue before this call drained it. size() locks the queue, so it is only asked
+	// when messages arrived.
+	void watermarkInput(FilteredInputQueue& queue, uint32_t popped) {
+		if (popped > 0) {
+			MidiStats::watermark(stats.inQueueMax, popped + queue.size());
+		}
+	}
+
+	void processButtons(const ProcessArgs& args) {
+		TraceScope scope(trace, TRACE_BUTTONS);
 
 		//---------------------------------------------------------------------------
 		// buttons:
@@ -308,6 +611,8 @@ struct NymphesControl : Module {
 		    mod_src = value_out;
 		    if ( mod_src != mod_src_last ) {
 		      mod_src_last = mod_src;
+		      // The mod sliders now show another page, the hardware knobs have to catch up again
+		      resetPickup(8, 44);
 		      for (int i = 0; i < 36; i++) {
 			if ( i < 28 ) {
 			  params[CONTROLLERS+i+28].setValue(mod_current_values[mod_src][i]);
@@ -375,13 +680,21 @@ struct NymphesControl : Module {
 		  else lights[PLAYMODE_LIGHTS+k].value = 0.0;
 		}
 		params[PLAYMODE].setValue(value_out);
-		
+	}
+
+	void processModFilters(const ProcessArgs& args) {
+		TraceScope scope(trace, TRACE_MOD_FILTERS);
+
 		//---------------------------------------------------------------------------
 		// mod controllers:		
 		
 		if (button_pressed == false) {
 		  for (int i = 0; i < 36; i++) {
 
+		    // values_in still holds the knob position from another mod page
+		    if (softTakeover && !pickedUp[i+8])
+		      continue;
+
 		    int cc = learnedCcs[i+8];
 		    float value_in = values_in[cc] / 127.f;
 		    
@@ -395,19 +708,216 @@ struct NymphesControl : Module {
 		    }
 		  }
 		}
+	}
+
+	void processClock(const ProcessArgs& args) {
+		TraceScope scope(trace, TRACE_CLOCK);
+		float voltage = inputs[CLOCK_INPUT].getVoltage();
+		bool connected = inputs[CLOCK_INPUT].isConnected();
+		bool pulse = clock.process(args.sampleTime, voltage, connected);
+
+		int ppqn = CLOCK_PPQN[clockPpqn];
+		if (clockOut.pulsesPerBeat != ppqn) {
+			if (clockOut.running)
+				midiOutput.transmit(stopMsg);
+			clockOut.reset();
+			clockOut.pulsesPerBeat = ppqn;
+		}
+
+		if (sendClock) {
+			int events = clockOut.process(args.sampleTime, pulse && connected, connected);
+			if (events & ClockPll::STOP)
+				midiOutput.transmit(stopMsg);
+			if (events & ClockPll::START)
+				midiOutput.transmit(startMsg);
+			if (events & ClockPll::TICK)
+				midiOutput.transmit(clockMsg);
+		} else if (clockOut.running) {
+			clockOut.reset();
+			midiOutput.transmit(stopMsg);
+		}
+
+		if (pulse && connected) {
+			randomModsClocked = true;
+		}
+
+		// Pulses count from 1, the first pulse of each beat or bar is the boundary
+		if (pulse && pcPending && (clock.pulses - 1) % (pcTiming == PC_NEXT_BEAT ? ppqn : ppqn * beatsPerBar) == 0) {
+			midiOutput.sendProgramGroup(pcBlock);
+			pcPending = false;
+		}
+	}
+
+	/*
+	 * Poly gates become notes, one channel per voice while it is held. The note and velocity are
+	 * taken when the gate opens. Gates on the same note share its voice, which is only released by
+	 * the last of them.
+	 */
+	void processNotes(const ProcessArgs& args) {
+		TraceScope scope(trace, TRACE_NOTES);
+		int channels = inputs[NOTE_GATE_INPUT].getChannels();
+		for (int c = 0; c < 16; c++) {
+			int voice = channelVoice[c];
+			float gate = c < channels ? inputs[NOTE_GATE_INPUT].getVoltage(c) : 0.f;
+			if (!channelGate[c] && gate >= 1.f) {
+				channelGate[c] = true;
+				if (channelStolen[c]) {
+					continue;
+				}
+				int note = clamp((int) std::round(inputs[NOTE_VOCT_INPUT].getPolyVoltage(c) * 12.f) + 60, 0, 127);
+				int velocity = 100;
+				if (inputs[NOTE_VELOCITY_INPUT].isConnected())
+					velocity = clamp((int) std::round(inputs[NOTE_VELOCITY_INPUT].getPolyVoltage(c) / 10.f * 127.f), 1, 127);
+				int stolen;
+				voice = voices.allocate(note, &stolen);
+				if (voice < 0) {
+					channelStolen[c] = true;
+					continue;
+				}
+				if (stolen >= 0) {
+					for (int k = 0; k < 16; k++) {
+						if (channelVoice[k] == voice) {
+							channelVoice[k] = -1;
+							channelStolen[k] = true;
+						}
+					}
+					sendNote(0x8, stolen, 0, voiceChannel[voice], args.frame);
+				}
+				channelVoice[c] = voice;
+				if (voices.holds[voice] == 1) {
+					voiceChannel[voice] = voiceChannels ? (midiOutput.getChannel() + 1 + voice) % 16 : midiOutput.getChannel();
+					sendNote(0x9, note, velocity, voiceChannel[voice], args.frame);
+				}
+			}
+			else if (channelGate[c] && gate <= 0.1f) {
+				channelGate[c] = false;
+				channelStolen[c] = false;
+				if (voice >= 0) {
+					int note = voices.note[voice];
+					if (voices.release(voice)) {
+						sendNote(0x8, note, 0, voiceChannel[voice], args.frame);
+					}
+					channelVoice[c] = -1;
+				}
+			}
+		}
+	}
+
+	void sendNote(uint8_t status, int note, int velocity, int channel, int64_t frame) {
+		midi::Message &m = noteMsg;
+		m.setStatus(status);
+		m.setChannel(channel);
+		m.setNote(note);
+		m.setValue(velocity);
+		m.setFrame(frame);
+		midiOutput.sendPriority(m);
+	}
+
+	void processMotion(const ProcessArgs& args) {
+		if (motionClear.exchange(false)) {
+			motion.clear();
+		}
+		int loopBeats = motionLoopBeats.exchange(0);
+		if (loopBeats > 0) {
+			motion.setLoopBeats(loopBeats);
+		}
+
+		uint32_t tick = motion.tickAt(clock.pulses, clock.phase(), CLOCK_PPQN[clockPpqn]);
+
+		// Played back values are set on the sliders, so they go out through the normal controller path
+		motion.advance(tick, [&](int controller, int page, int value) {
+			if (isModSlider(controller) && page != mod_src) {
+				return;
+			}
+			params[CONTROLLERS+controller].setValue(value);
+			motion_last[controller] = value;
+		});
+
+		// Switching mod source swaps the values on the mod sliders, that is not a move
+		if (mod_src != motion_page_last) {
+			motion_page_last = mod_src;
+			for (int i = 0; i < 36; i++) {
+				motion_last[modSlider(i)] = (int) params[CONTROLLERS+modSlider(i)].getValue();
+			}
+		}
+
+		// Slider moves and incoming CCs both end up on the sliders
+		for (int i = 0; i < 74; i++) {
+			int value = (int) params[CONTROLLERS+i].getValue();
+			if (value != motion_last[i]) {
+				motion_last[i] = value;
+				motion.record(tick, i, isModSlider(i) ? mod_src : 0, clamp(value, 0, 127));
+			}
+		}
+	}
+
+	void processHistory(const ProcessArgs& args) {
+		// Compare the patch every 10ms, a step ends after 250ms without changes
+		if (++historyCount < 20) {
+			return;
+		}
+		historyCount = 0;
+
+		NymphesPatch patch;
+		int request = historyRequest.exchange(HISTORY_NONE);
+		if (request == HISTORY_RESTART) {
+			toPatch(&patch);
+			history.reset(patch);
+			return;
+		}
+		if (request == HISTORY_UNDO || request == HISTORY_REDO) {
+			// Restored values go out through the normal controller path, the tracked state already has them
+			if (request == HISTORY_UNDO ? history.undo(&patch) : history.redo(&patch)) {
+				fromPatch(patch);
+			}
+			return;
+		}
+		if (request == HISTORY_JUMP) {
+			// Replays from the nearest keyframe, so any step is at most KEYFRAME_INTERVAL steps away
+			if (history.jump(historyTarget.load(), &patch)) {
+				fromPatch(patch);
+			}
+			return;
+		}
 
+		toPatch(&patch);
+		if (history.track(patch)) {
+			historyIdle = 0;
+		} else if (++historyIdle == 25) {
+			history.close();
+		}
+	}
+
+	bool rateLimiter(const ProcessArgs& args) {
 		//------------------
 		//x
-		const float rateLimiterPeriod = 0.0005f;
-		rateLimiterPhase += args.sampleTime / rateLimiterPeriod;
+		rateLimiterPhase += args.sampleTime / CONTROL_PERIOD;
 		if (rateLimiterPhase >= 1.f) {
 			rateLimiterPhase -= 1.f;
 		}
 		else {
-			return;
+			return false;
 		}
 
 		// std::cout << " args.sampleTime: " << args.sampleTime << std::endl;
+		return true;
+	}
+
+	void processRandomMods(const ProcessArgs& args) {
+		randomMods.process(CONTROL_PERIOD, inputs[CLOCK_INPUT].isConnected(), randomModsClocked);
+		randomModsClocked = false;
+	}
+
+	/*
+	 * Random modulation of a slider in CC steps. It is added to the value sent, the slider itself
+	 * never moves.
+	 */
+	int getModOffset(int slider) {
+		return (int) std::round(randomMods.out[slider] * 127.f);
+	}
+
+	void processModControllers(const ProcessArgs& args) {
+		TraceScope scope(trace, TRACE_MOD_CONTROLLERS);
 
 		count1++;
 			
@@ -437,6 +947,8 @@ struct NymphesControl : Module {
 		      value_changed = true;
 		    }
 		    if (mod_controller_values_last[mod_src][i] != (int) params[CONTROLLERS+i+28].getValue()) {
+		      pickedUp[i+8] = false;
+		      touched(i+8);
 		      value_out = value_out + (int) params[CONTROLLERS+i+28].getValue();
 		      mod_controller_values_last[mod_src][i] = (int) params[CONTROLLERS+i+28].getValue();
 		      value_changed = true;
@@ -448,6 +960,8 @@ struct NymphesControl : Module {
 		      value_changed = true;
 		    }
 		    if (mod_controller_values_last[mod_src][i] != (int) params[CONTROLLERS+i+32].getValue()) {
+		      pickedUp[i+8] = false;
+		      touched(i+8);
 		      value_out = value_out + (int) params[CONTROLLERS+i+32].getValue();
 		      mod_controller_values_last[mod_src][i] = (int) params[CONTROLLERS+i+32].getValue();
 		      value_changed = true;
@@ -459,19 +973,14 @@ struct NymphesControl : Module {
 		      value_changed = true;
 		    }
 		    if (mod_controller_values_last[mod_src][i] != (int) params[CONTROLLERS+i+36].getValue()) {
+		      pickedUp[i+8] = false;
+		      touched(i+8);
 		      value_out = value_out + (int) params[CONTROLLERS+i+36].getValue();
 		      mod_controller_values_last[mod_src][i] = (int) params[CONTROLLERS+i+36].getValue();
 		      value_changed = true;
 		    }
 		  }			
 		  value_out = clamp(value_out, 0, 127);
-		  if (last_mod_value[mod_src][i] != value_out && value_changed) {
-		    if (count1 > slow_control) {
-		      count1 = 0;
-		      midiOutput.setValue(value_out, learnedCcs[i+8]);
-		      last_mod_value[mod_src][i] = value_out;
-		    }
-		  }
 		  if (value_changed) {
 		    if ( i < 28 ) {
 		      params[CONTROLLERS+i+28].setValue(value_out);
@@ -485,9 +994,26 @@ struct NymphesControl : Module {
 		    }
 		    mod_current_values[mod_src][i] = value_out;
 		  }
+		  int slider = i < 28 ? i + 28 : (i < 32 ? i + 32 : i + 36);
+		  int mod = getModOffset(slider);
+		  int sent = clamp(mod_current_values[mod_src][i] + mod, 0, 127);
+		  if (last_mod_value[mod_src][i] != sent && (value_changed || mod != mod_offset_last[slider])) {
+		    if (count1 > slow_control) {
+		      count1 = 0;
+		      midiOutput.setValue(sent, learnedCcs[i+8]);
+		      last_mod_value[mod_src][i] = sent;
+		      mod_offset_last[slider] = mod;
+		    } else {
+		      MidiStats::add(stats.throttled);
+		    }
+		  }
 		  mod_display_values[i] = mod_current_values[mod_src][i];
 		}
-		
+	}
+
+	void processControllers(const ProcessArgs& args) {
+		TraceScope scope(trace, TRACE_CONTROLLERS);
+
 		//---------------------------------------------------------------------------
 		// normal controllers:
 		
@@ -545,25 +1071,36 @@ struct NymphesControl : Module {
 		  }
 		  //bug if (controller_values_last[slider_idx] != (int) params[CONTROLLERS+slider_idx].getValue()) {
 		  if (controller_values_last[value_idx] != (int) params[CONTROLLERS+slider_idx].getValue()) {
+		    pickedUp[cc_idx] = false;
+		    touched(cc_idx);
 		    value_out = value_out + (int) params[CONTROLLERS+slider_idx].getValue();
 		    //bug controller_values_last[slider_idx] = (int) params[CONTROLLERS+slider_idx].getValue();
 		    controller_values_last[value_idx] = (int) params[CONTROLLERS+slider_idx].getValue();
 		    value_changed = true;
 		  }
 		  value_out = clamp(value_out, 0, 127);
-		  if (last_value_out[value_idx] != value_out && value_changed) {
-		    if (count2 > slow_control) {
-		      count2 = 0;
-		      midiOutput.setValue(value_out, learnedCcs[cc_idx]);
-		      last_value_out[value_idx] = value_out;
-		    }
-		  }
 		  if (value_changed) {
 		    params[CONTROLLERS+slider_idx].setValue(value_out);
 		    lights[CTRL_LIGHTS + slider_idx].setBrightness((value_out+1.)/128.);
 		    current_values[value_idx] = value_out;
 		  }
-		}		
+		  int mod = getModOffset(slider_idx);
+		  int sent = clamp(current_values[value_idx] + mod, 0, 127);
+		  if (last_value_out[value_idx] != sent && (value_changed || mod != mod_offset_last[slider_idx])) {
+		    if (count2 > slow_control) {
+		      count2 = 0;
+		      midiOutput.setValue(sent, learnedCcs[cc_idx]);
+		      last_value_out[value_idx] = sent;
+		      mod_offset_last[slider_idx] = mod;
+		    } else {
+		      MidiStats::add(stats.throttled);
+		    }
+		  }
+		}
+	}
+
+	void processProgramChange(const ProcessArgs& args) {
+		TraceScope scope(trace, TRACE_PROGRAM_CHANGE);
 
 		//------
 
@@ -589,11 +1126,9 @@ struct NymphesControl : Module {
 
 		if (factory_last != factory) {
 		  factory_last = factory;
-		  if(factory) {
-		    midiOutput.setValue(1, 0);
-		    midiOutput.setValue(0, 32);
-		  } else {
-		    midiOutput.setValue(0, 0);
+		  // A scheduled change sends the bank with the program
+		  if (pcTiming == PC_IMMEDIATE) {
+		    midiOutput.setValue(factory ? 1 : 0, 0);
 		    midiOutput.setValue(0, 32);
 		  }
 		}
@@ -630,8 +1165,29 @@ struct NymphesControl : Module {
 		if(target_program/7 == 6) current_bank = 'G';
 
 		if(sendPCTrigger.process(fmax(params[PROGRAM_SEND].getValue(), inputs[CV_PC_SEND].getVoltage()))) {
-		  midiOutput.sendProgram(target_program);
+		  if (pcTiming == PC_IMMEDIATE) {
+		    midiOutput.sendProgram(target_program);
+		  } else {
+		    schedulePC(target_program, factory);
+		  }
 		}
+	}
+
+	void schedulePC(uint8_t program, bool factoryBank) {
+		pcBlock[0].setStatus(0xb);
+		pcBlock[0].setNote(0);
+		pcBlock[0].setValue(factoryBank ? 1 : 0);
+		pcBlock[1].setStatus(0xb);
+		pcBlock[1].setNote(32);
+		pcBlock[1].setValue(0);
+		pcBlock[2].setStatus(0xc);
+		pcBlock[2].setNote(program);
+		pcBlock[2].setValue(0);
+		pcPending = true;
+	}
+
+	void processFiles(const ProcessArgs& args) {
+		TraceScope scope(trace, TRACE_FILES);
 
 		//--------
 
@@ -672,13 +1228,13 @@ struct NymphesControl : Module {
 		  }
 		  osdialog_filters *filters = osdialog_filters_parse(NYM_FILTERS_save.c_str());
 		  char *path = osdialog_file(OSDIALOG_SAVE, dir.c_str(), NULL, filters);
-		  // Append .nym extension if no extension was given.
-		  std::string pathStr = path;
-		  if (system::getExtension(pathStr) != ".nym") {
-		  // if (string::filenameExtension(string::filename(pathStr)) == "") {
-		    pathStr += ".nym";
-		  }
 		  if (path) {
+		    // Append .nym extension if no extension was given.
+		    std::string pathStr = path;
+		    if (system::getExtension(pathStr) != ".nym") {
+		    // if (string::filenameExtension(string::filename(pathStr)) == "") {
+		      pathStr += ".nym";
+		    }
 		    save(pathStr);
 		    lastPath = pathStr;
 		    free(path);
@@ -690,134 +1246,108 @@ struct NymphesControl : Module {
 
 		load_last_value = params[LOAD].getValue();
 		save_last_value = params[SAVE].getValue();
-		
 	}
 
         void load(std::string filename) {
 
-	  FILE *patchFile = fopen(filename.c_str(), "r");
-	  if (!patchFile) {
-	    // Exit silently
+	  NymphesPatch patch;
+	  if (!patch.load(filename)) {
+	    // Exit silently, keeping the current settings if the file is unreadable or malformed
 	    return;
 	  }
 
-	  int value_in = 0;
-	  // char line[1000], colname[1000];
-	  char line[1000];
-	  std::vector<int> result;
-	  int val;
-	  // Read data, line by line
-	  while(fgets(line,1000,patchFile))
-	    {
-	      // Create a stringstream of the current line
-	      std::stringstream ss(line);
-	      
-	      // Keep track of the current column index
-	      int colIdx = 0;
-	      
-	      // Extract each integer
-	      while(ss >> val){
-		
-	     	// Add the current integer to the 'colIdx' column's values vector
-		result.push_back(val);
-		
-	     	// If the next token is a comma, ignore it and move on
-	     	if(ss.peek() == ',') ss.ignore();
-		
-	     	// Increment the column index
-	     	colIdx++;
-	      }
-	    }
-	  
-	  int indx = 0;
+	  fromPatch(patch);
+	}
+
+        void save(std::string savefilename) {
+
+	  NymphesPatch patch;
+	  toPatch(&patch);
+	  // Exit silently
+	  patch.save(savefilename);
+
+	}
+
+        void toPatch(NymphesPatch *patch) {
+
 	  for (int i = 0; i < 38; i++) {
-	    value_in = result.at(i);
-	    if ( i < 28 ) {
-	      params[CONTROLLERS+i].setValue(value_in);
-	    } else if ( i >= 28 && i < 32 ) {
-	      params[CONTROLLERS+ i + 28].setValue(value_in);
-	    } else if ( i >= 32 && i < 36 ) {
-	      params[CONTROLLERS+ i + 32].setValue(value_in);
-	    } else {
-	      params[CONTROLLERS+ i + 36].setValue(value_in);
-	    }
-	    indx++;
+	    // The sliders go up to 128 but a MIDI value stops at 127
+	    patch->controllers[i] = std::min(int(params[CONTROLLERS+controllerSlider(i)].getValue()), 127);
 	  }
 
 	  for (int i = 0; i < 4; i++) {
 	    for (int j = 0; j < 36; j++) {
-	      value_in = result.at(indx);
-	      mod_current_values[i][j] = value_in;
-	      indx++;
+	      patch->mod_values[i][j] = std::min(mod_current_values[i][j], 127);
 	    }
 	  }
 
+	  // An incoming CC can leave a button past its last setting, which a patch can't hold
 	  for (int j = 0; j < 7; j++) {
-	    value_in = result.at(indx);
-	    button_settings[j] = value_in;
-	    if (j == 2) mod_src = value_in;
-	    indx++;
+	    patch->buttons[j] = clamp(button_settings[j], 0, NymphesPatch::BUTTON_MAX[j]);
 	  }
+	  patch->playmode = clamp(int(params[PLAYMODE].getValue()), 0, NymphesPatch::PLAYMODE_MAX);
 
-	  for (int i = 0; i < 36; i++) {
-	    if ( i < 28 ) {
-	      params[CONTROLLERS+i+28].setValue(mod_current_values[mod_src][i]);
-	    } else if ( i >= 28 && i < 32 ) {
-	      params[CONTROLLERS+i+32].setValue(mod_current_values[mod_src][i]);
-	    } else {
-	      params[CONTROLLERS+i+36].setValue(mod_current_values[mod_src][i]);		
-	    }
-	  }
-
-	  value_in = result.at(indx);
-	  params[PLAYMODE].setValue(value_in);
 	}
 
-        void save(std::string savefilename) {
+        void fromPatch(const NymphesPatch &patch) {
 
-	  FILE *patchFile = fopen(savefilename.c_str(), "w");
-	  if (!patchFile) {
-	    // Exit silently
-	    return;
+	  for (int i = 0; i < 38; i++) {
+	    params[CONTROLLERS+controllerSlider(i)].setValue(patch.controllers[i]);
 	  }
 
-	  
-	  for (int i = 0; i < 28; i++) {
-	    std::string value = std::to_string(int(params[CONTROLLERS+i].getValue())) + ", ";
-	    fputs(value.c_str(),patchFile);
+	  for (int i = 0; i < 4; i++) {
+	    for (int j = 0; j < 36; j++) {
+	      mod_current_values[i][j] = patch.mod_values[i][j];
+	    }
 	  }
 
-	  for (int i = 56; i < 60; i++) {
-	    std::string value = std::to_string(int(params[CONTROLLERS+i].getValue())) + ", ";
-	    fputs(value.c_str(),patchFile);
+	  for (int j = 0; j < 7; j++) {
+	    button_settings[j] = patch.buttons[j];
+	    if (j == 2) mod_src = patch.buttons[j];
 	  }
 
-	  for (int i = 64; i < 68; i++) {
-	    std::string value = std::to_string(int(params[CONTROLLERS+i].getValue())) + ", ";
-	    fputs(value.c_str(),patchFile);
-	  }
-	  
-	  for (int i = 72; i < 74; i++) {
-	    std::string value = std::to_string(int(params[CONTROLLERS+i].getValue())) + ", ";
-	    fputs(value.c_str(),patchFile);
+	  for (int i = 0; i < 36; i++) {
+	    params[CONTROLLERS+modSlider(i)].setValue(mod_current_values[mod_src][i]);
 	  }
 
-	  for (int i = 0; i < 4; i++) {
-	    for (int j = 0; j < 36; j++) {
-	      std::string value = std::to_string(mod_current_values[i][j]) + ", ";
-	      fputs(value.c_str(),patchFile);
-	    }
-	  }
-	    	  
-	  for (int j = 0; j < 7; j++) {
-	    std::string value = std::to_string(button_settings[j]) + ", ";
-	    fputs(value.c_str(),patchFile);
+	  params[PLAYMODE].setValue(patch.playmode);
+	}
+
+        // Slider index of normal controller i (0-37): 0-27 are the two main rows, then reverb, lfo2 and the last two
+        static int controllerSlider(int i) {
+	  if ( i < 28 ) {
+	    return i;
+	  } else if ( i < 32 ) {
+	    return i + 28;
+	  } else if ( i < 36 ) {
+	    return i + 32;
 	  }
-	  std::string value = std::to_string(int(params[PLAYMODE].getValue())) + "\n";
-	  fputs(value.c_str(),patchFile);
+	  return i + 36;
+	}
 
-	  fclose(patchFile);
+        static bool isModSlider(int slider) {
+	  return (slider >= 28 && slider < 56) || (slider >= 60 && slider < 64) || (slider >= 68 && slider < 72);
+	}
 
+        // Index into learnedCcs of the CC a slider sends
+        static int sliderTarget(int slider) {
+	  if (slider < 28) return slider + 44;
+	  if (slider < 56) return slider - 20;
+	  if (slider < 60) return slider + 16;
+	  if (slider < 64) return slider - 24;
+	  if (slider < 68) return slider + 12;
+	  if (slider < 72) return slider - 28;
+	  return slider + 8;
+	}
+
+        // Slider index of mod controller i (0-35): 0-27 are the two mod rows, then reverb mod and lfo2 mod
+        static int modSlider(int i) {
+	  if ( i < 28 ) {
+	    return i + 28;
+	  } else if ( i < 32 ) {
+	    return i + 32;
+	  }
+	  return i + 36;
 	}
 
   
@@ -834,15 +1364,112 @@ struct NymphesControl : Module {
 		}
 	}
 
-	void processCC(midi::Message msg) {
+	void processCC(const midi::Message& msg) {
 		uint8_t cc = msg.getNote();
 		// Allow CC to be negative if the 8th bit is set.
 		// The gamepad driver abuses this, for example.
 		// Cast uint8_t to int8_t
 		int8_t value_in = msg.bytes[2];
 		value_in = clamp(value_in, -127, 127);
-		// Learn
-		values_in[cc] = value_in;
+		// Our own output coming back would otherwise be sent out again, and again
+		if (midiOutput.echoes.match(msg.getChannel(), cc, value_in, msg.frame)) {
+			MidiStats::add(stats.echoes);
+			return;
+		}
+		setControllerCc(cc, value_in);
+	}
+
+	void setControllerCc(uint8_t cc, int value) {
+		if (softTakeover && !pickup(cc, value)) {
+			return;
+		}
+		values_in[cc] = value;
+	}
+
+	/*
+	 * Messages from the external controller port only ever go through the remap table.
+	 */
+	void processControllerMessage(const midi::Message &msg) {
+		if (remapLearn.load(std::memory_order_relaxed) == REMAP_WAIT_CC && msg.getStatus() == 0xb) {
+			remap.set(msg.getChannel(), msg.getNote(), remapTarget);
+			remapLearn.store(REMAP_IDLE);
+			return;
+		}
+		int value;
+		int target = remap.map(msg, &value);
+		if (target >= 8 && target < 82) {
+			setControllerCc(learnedCcs[target], value);
+		}
+	}
+
+	/*
+	 * Merges the thru input into the output. Notes and sustain go ahead of the CCs waiting to be
+	 * sent, so a burst of controller changes can't hold back a note-on.
+	 */
+	void processThruMessage(const midi::Message &msg) {
+		uint8_t status = msg.getStatus();
+		if (status == 0x8 || status == 0x9 || (status == 0xb && msg.getNote() == 64)) {
+			midiOutput.sendPriority(msg);
+		} else {
+			midiOutput.send(msg);
+		}
+	}
+
+	/*
+	 * A slider was moved on the panel, it becomes the target while learning a remap.
+	 */
+	void touched(int target) {
+		if (remapLearn.load(std::memory_order_relaxed) == REMAP_WAIT_SLIDER) {
+			remapTarget = target;
+			remapLearn.store(REMAP_WAIT_CC);
+		}
+	}
+
+	/*
+	 * Only the learned CCs and bank select get past the driver callback when the input filter
+	 * limits CCs.
+	 */
+	void updateInputFilter() {
+		bool allowed[128] = {};
+		for (int i = 0; i < 82; i++) {
+			if (learnedCcs[i] >= 0 && learnedCcs[i] < 128)
+				allowed[learnedCcs[i]] = true;
+		}
+		allowed[0] = true;
+		allowed[32] = true;
+		midiInput.setCcWhitelist(allowed);
+	}
+
+	void resetPickup(int from, int to) {
+		for (int k = from; k < to; k++) {
+			pickedUp[k] = false;
+			pickupLast[k] = -1;
+		}
+	}
+
+	/*
+	 * Soft takeover for a controller CC, true once the incoming value has reached or crossed the
+	 * value the module has for it. Moving the slider on the panel lets go of it again.
+	 */
+	bool pickup(uint8_t cc, int value) {
+		if (softTakeover != softTakeoverLast) {
+			softTakeoverLast = softTakeover;
+			resetPickup(8, 82);
+		}
+		for (int k = 8; k < 82; k++) {
+			if (learnedCcs[k] != cc) {
+				continue;
+			}
+			if (!pickedUp[k]) {
+				int current = k < 44 ? mod_current_values[mod_src][k-8] : (int) params[CONTROLLERS+controllerSlider(k-44)].getValue();
+				int last = pickupLast[k];
+				pickupLast[k] = value;
+				pickedUp[k] = value == current || (last >= 0 && (last < current) != (value < current));
+			}
+			return pickedUp[k];
+		}
+		// Buttons and anything unmapped pass straight through
+		return true;
 	}
 
 	void processPC(midi::Message msg) {
@@ -855,6 +1482,29 @@ struct NymphesControl : Module {
 		params[PROGRAM_KNOB].setValue(program);
 	}
 
+	// The capture has to be stopped first
+	void exportTrace(std::string filename) {
+		static const char *const traceNames[NUM_TRACE_SECTIONS] = {
+			"process",
+			"midi pop",
+			"buttons",
+			"mod filters",
+			"clock",
+			"notes",
+			"mod controllers",
+			"controllers",
+			"program change",
+			"files"
+		};
+		trace.exportChrome(filename, traceNames, NUM_TRACE_SECTIONS);
+	}
+
+	void dumpStats(std::string filename) {
+		json_t* statsJ = stats.toJson();
+		json_dump_file(statsJ, filename.c_str(), JSON_INDENT(2));
+		json_decref(statsJ);
+	}
+
 	json_t* dataToJson() override {
 		json_t* rootJ = json_object();
 
@@ -871,12 +1521,53 @@ struct NymphesControl : Module {
 		}
 		json_object_set_new(rootJ, "values_in", values_inJ);
 
+		json_t* motionJ = json_object();
+		json_object_set_new(motionJ, "loopBeats", json_integer(motion.loopBeats));
+		json_object_set_new(motionJ, "playing", json_boolean(motion.playing));
+		json_t* eventsJ = json_array();
+		for (int i = 0; i < motion.numEvents; i++) {
+			const MotionRecorder::Event& e = motion.events[i];
+			json_array_append_new(eventsJ, json_integer(e.tick));
+			json_array_append_new(eventsJ, json_integer(e.controller));
+			json_array_append_new(eventsJ, json_integer(e.page));
+			json_array_append_new(eventsJ, json_integer(e.value));
+		}
+		json_object_set_new(motionJ, "events", eventsJ);
+		json_object_set_new(rootJ, "motion", motionJ);
+
+		json_object_set_new(rootJ, "voiceMode", json_integer(voices.mode));
+		json_object_set_new(rootJ, "voiceChannels", json_boolean(voiceChannels));
+		json_object_set_new(rootJ, "pcTiming", json_integer(pcTiming));
+		json_object_set_new(rootJ, "sendClock", json_boolean(sendClock));
+		json_object_set_new(rootJ, "clockPpqn", json_integer(CLOCK_PPQN[clockPpqn]));
+		json_object_set_new(rootJ, "beatsPerBar", json_integer(beatsPerBar));
+		json_object_set_new(rootJ, "suppressEchoes", json_boolean(midiOutput.echoes.enabled));
+		json_object_set_new(rootJ, "softTakeover", json_boolean(softTakeover));
+		json_t* inputFilterJ = json_object();
+		json_object_set_new(inputFilterJ, "statusMask", json_integer(midiInput.statusMask.load()));
+		json_object_set_new(inputFilterJ, "learnedCcsOnly", json_boolean(midiInput.ccWhitelistOnly.load()));
+		json_object_set_new(rootJ, "inputFilter", inputFilterJ);
+		json_t* randomModsJ = json_object();
+		json_t* modesJ = json_array();
+		json_t* depthsJ = json_array();
+		for (int i = 0; i < 74; i++) {
+			json_array_append_new(modesJ, json_integer(randomMods.mode[i]));
+			json_array_append_new(depthsJ, json_real(randomMods.depth[i]));
+		}
+		json_object_set_new(randomModsJ, "modes", modesJ);
+		json_object_set_new(randomModsJ, "depths", depthsJ);
+		json_object_set_new(randomModsJ, "rate", json_real(randomMods.rate));
+		json_object_set_new(rootJ, "randomMods", randomModsJ);
+		json_object_set_new(rootJ, "remap", remap.toJson());
+		json_object_set_new(rootJ, "controllerMidi", controllerInput.toJson());
+		json_object_set_new(rootJ, "thruMidi", thruInput.toJson());
 		json_object_set_new(rootJ, "midi", midiInput.toJson());
 		json_object_set_new(rootJ, "midiOut", midiOutput.toJson());
 		return rootJ;
 	}
 
 	void dataFromJson(json_t* rootJ) override {
+		historyRequest.store(HISTORY_RESTART);
 		json_t* ccsJ = json_object_get(rootJ, "ccs");
 		if (ccsJ) {
 			for (int i = 0; i < 82; i++) {
@@ -884,6 +1575,7 @@ struct NymphesControl : Module {
 				if (ccJ)
 					learnedCcs[i] = json_integer_value(ccJ);
 			}
+			updateInputFilter();
 		}
 
 		json_t* values_inJ = json_object_get(rootJ, "values_in");
@@ -897,6 +1589,110 @@ struct NymphesControl : Module {
 			}
 		}
 		
+		json_t* motionJ = json_object_get(rootJ, "motion");
+		if (motionJ) {
+			motion.clear();
+			json_t* loopBeatsJ = json_object_get(motionJ, "loopBeats");
+			if (loopBeatsJ)
+				motion.loopBeats = clamp((int) json_integer_value(loopBeatsJ), 1, 256);
+			json_t* playingJ = json_object_get(motionJ, "playing");
+			if (playingJ)
+				motion.playing = json_boolean_value(playingJ);
+			json_t* eventsJ = json_object_get(motionJ, "events");
+			size_t numEvents = eventsJ ? std::min(json_array_size(eventsJ) / 4, (size_t) MotionRecorder::MAX_EVENTS) : 0;
+			json_int_t lastTick = 0;
+			for (size_t i = 0; i < numEvents; i++) {
+				json_int_t tick = json_integer_value(json_array_get(eventsJ, 4 * i));
+				json_int_t controller = json_integer_value(json_array_get(eventsJ, 4 * i + 1));
+				json_int_t page = json_integer_value(json_array_get(eventsJ, 4 * i + 2));
+				json_int_t value = json_integer_value(json_array_get(eventsJ, 4 * i + 3));
+				// Only take well formed, sorted events, checked before they are narrowed to the
+				// event fields. Patches saved before the loop was trimmed on shortening can have
+				// events past its end, those are dropped like the trim would.
+				if (tick >= motion.loopTicks())
+					continue;
+				if (tick < lastTick || controller < 0 || controller >= MotionRecorder::NUM_CONTROLLERS
+				    || page < 0 || page >= MotionRecorder::NUM_PAGES || value < 0 || value > 127)
+					break;
+				lastTick = tick;
+				MotionRecorder::Event& e = motion.events[motion.numEvents++];
+				e.tick = tick;
+				e.controller = controller;
+				e.page = page;
+				e.value = value;
+			}
+		}
+
+		json_t* voiceModeJ = json_object_get(rootJ, "voiceMode");
+		if (voiceModeJ)
+			voices.mode = clamp((int) json_integer_value(voiceModeJ), 0, VoiceAllocator::NUM_MODES - 1);
+
+		json_t* voiceChannelsJ = json_object_get(rootJ, "voiceChannels");
+		if (voiceChannelsJ)
+			voiceChannels = json_boolean_value(voiceChannelsJ);
+
+		json_t* pcTimingJ = json_object_get(rootJ, "pcTiming");
+		if (pcTimingJ)
+			pcTiming = clamp((int) json_integer_value(pcTimingJ), (int) PC_IMMEDIATE, (int) PC_NEXT_BAR);
+		json_t* sendClockJ = json_object_get(rootJ, "sendClock");
+		if (sendClockJ)
+			sendClock = json_boolean_value(sendClockJ);
+		json_t* clockPpqnJ = json_object_get(rootJ, "clockPpqn");
+		if (clockPpqnJ) {
+			for (int i = 0; i < (int) LENGTHOF(CLOCK_PPQN); i++) {
+				if (CLOCK_PPQN[i] == json_integer_value(clockPpqnJ))
+					clockPpqn = i;
+			}
+		}
+		json_t* beatsPerBarJ = json_object_get(rootJ, "beatsPerBar");
+		if (beatsPerBarJ)
+			beatsPerBar = clamp((int) json_integer_value(beatsPerBarJ), 1, 16);
+
+		json_t* suppressEchoesJ = json_object_get(rootJ, "suppressEchoes");
+		if (suppressEchoesJ)
+			midiOutput.echoes.enabled = json_boolean_value(suppressEchoesJ);
+
+		json_t* softTakeoverJ = json_object_get(rootJ, "softTakeover");
+		if (softTakeoverJ)
+			softTakeover = json_boolean_value(softTakeoverJ);
+
+		json_t* inputFilterJ = json_object_get(rootJ, "inputFilter");
+		if (inputFilterJ) {
+			json_t* statusMaskJ = json_object_get(inputFilterJ, "statusMask");
+			if (statusMaskJ)
+				midiInput.statusMask.store(json_integer_value(statusMaskJ));
+			json_t* learnedCcsOnlyJ = json_object_get(inputFilterJ, "learnedCcsOnly");
+			if (learnedCcsOnlyJ)
+				midiInput.ccWhitelistOnly.store(json_boolean_value(learnedCcsOnlyJ));
+		}
+
+		json_t* randomModsJ = json_object_get(rootJ, "randomMods");
+		if (randomModsJ) {
+			json_t* modesJ = json_object_get(randomModsJ, "modes");
+			json_t* depthsJ = json_object_get(randomModsJ, "depths");
+			for (int i = 0; i < 74; i++) {
+				json_t* modeJ = json_array_get(modesJ, i);
+				if (modeJ)
+					randomMods.mode[i] = clamp((int) json_integer_value(modeJ), 0, RandomModulators<74>::NUM_MODES - 1);
+				json_t* depthJ = json_array_get(depthsJ, i);
+				if (depthJ)
+					randomMods.depth[i] = clamp((float) json_number_value(depthJ), 0.f, 1.f);
+			}
+			json_t* rateJ = json_object_get(randomModsJ, "rate");
+			if (rateJ)
+				randomMods.rate = clamp((float) json_number_value(rateJ), 0.01f, 20.f);
+		}
+
+		json_t* remapJ = json_object_get(rootJ, "remap");
+		if (remapJ)
+			remap.fromJson(remapJ);
+		json_t* controllerMidiJ = json_object_get(rootJ, "controllerMidi");
+		if (controllerMidiJ)
+			controllerInput.fromJson(controllerMidiJ);
+		json_t* thruMidiJ = json_object_get(rootJ, "thruMidi");
+		if (thruMidiJ)
+			thruInput.fromJson(thruMidiJ);
+
 		json_t* midiJ = json_object_get(rootJ, "midi");
 		if (midiJ) {
 			midiInput.fromJson(midiJ);
@@ -1021,6 +1817,69 @@ struct DisplayWidget : TransparentWidget {
 };
 ////////////////////////////////////
 
+////////////////////////////////////
+// Text on the panel for jacks that the panel artwork doesn't name
+struct PanelLabel : TransparentWidget {
+  std::string text;
+  std::string _fontPath;
+
+  PanelLabel() :
+  _fontPath(asset::system("res/fonts/ShareTechMono-Regular.ttf"))
+  {
+  };
+
+  void draw(const DrawArgs& args) override
+  {
+    std::shared_ptr<Font> font = APP->window->loadFont(_fontPath);
+    if(font) {
+      nvgFontSize(args.vg, 9);
+      nvgFontFaceId(args.vg, font->handle);
+      nvgTextAlign(args.vg, NVG_ALIGN_CENTER | NVG_ALIGN_MIDDLE);
+      nvgFillColor(args.vg, nvgRGB(0x20, 0x20, 0x20));
+      nvgText(args.vg, box.size.x / 2, box.size.y / 2, text.c_str(), NULL);
+    }
+  }
+};
+////////////////////////////////////
+
+
+////////////////////////////////////
+// Menu slider for the value a remapped CC sends at 0 (low) or at 127 (high)
+struct RemapRangeQuantity : Quantity {
+  NymphesControl* module;
+  int channel;
+  int cc;
+  bool high;
+
+  RemapRangeQuantity(NymphesControl* module, int channel, int cc, bool high) :
+    module(module), channel(channel), cc(cc), high(high) {}
+
+  float getValue() override {
+    const MidiRemap::Entry &e = module->remap.table[channel][cc];
+    return high ? e.max : e.min;
+  }
+  void setValue(float value) override {
+    MidiRemap::Entry e = module->remap.table[channel][cc];
+    int v = clamp((int) std::round(value), 0, 127);
+    module->remap.post(channel, cc, e.target, high ? e.min : v, high ? v : e.max);
+  }
+  float getMinValue() override { return 0.f; }
+  float getMaxValue() override { return 127.f; }
+  float getDefaultValue() override { return high ? 127.f : 0.f; }
+  std::string getLabel() override { return high ? "Output at 127" : "Output at 0"; }
+  std::string getDisplayValueString() override { return string::f("%d", (int) getValue()); }
+};
+
+struct RemapRangeSlider : ui::Slider {
+  RemapRangeSlider(NymphesControl* module, int channel, int cc, bool high) {
+    quantity = new RemapRangeQuantity(module, channel, cc, high);
+  }
+  ~RemapRangeSlider() {
+    delete quantity;
+  }
+};
+////////////////////////////////////
+
 
 struct NymphesControlWidget : ModuleWidget {
   NymphesControlWidget(NymphesControl* module) {
@@ -1150,6 +2009,23 @@ struct NymphesControlWidget : ModuleWidget {
     addChild(createLight<SmallLight<RedLight>>(mm2px(Vec(10.5, 74.5)), module, NymphesControl::PC_BANK_LIGHTS+1));
     addInput(createInputCentered<PJ301MPort>(mm2px(Vec(8.5, 94)), module, NymphesControl::CV_PC));
     addInput(createInputCentered<PJ301MPort>(mm2px(Vec(38, 94)), module, NymphesControl::CV_PC_SEND));
+    addInput(createInputCentered<PJ301MPort>(mm2px(Vec(23.25, 94)), module, NymphesControl::CLOCK_INPUT));
+    PanelLabel* clockLabel = createWidget<PanelLabel>(mm2px(Vec(17.25, 86.5)));
+    clockLabel->box.size = mm2px(Vec(12, 3.5));
+    clockLabel->text = "CLOCK";
+    addChild(clockLabel);
+    addInput(createInputCentered<PJ301MPort>(mm2px(Vec(8.5, 117.5)), module, NymphesControl::NOTE_VOCT_INPUT));
+    addInput(createInputCentered<PJ301MPort>(mm2px(Vec(23.25, 117.5)), module, NymphesControl::NOTE_GATE_INPUT));
+    addInput(createInputCentered<PJ301MPort>(mm2px(Vec(38, 117.5)), module, NymphesControl::NOTE_VELOCITY_INPUT));
+    // Below the jacks, the LOAD and SAVE buttons leave no room above them
+    const char* noteLabels[] = {"V/OCT", "GATE", "VEL"};
+    const float noteLabelX[] = {8.5, 23.25, 38};
+    for (int i = 0; i < 3; i++) {
+      PanelLabel* noteLabel = createWidget<PanelLabel>(mm2px(Vec(noteLabelX[i] - 6, 122)));
+      noteLabel->box.size = mm2px(Vec(12, 3.5));
+      noteLabel->text = noteLabels[i];
+      addChild(noteLabel);
+    }
     
     
     // 		70  // 0-3 lfo1 type
@@ -1233,6 +2109,270 @@ struct NymphesControlWidget : ModuleWidget {
 		}
   
   }
+
+  void appendContextMenu(Menu* menu) override {
+    NymphesControl* module = dynamic_cast<NymphesControl*>(this->module);
+    if (!module)
+      return;
+
+    menu->addChild(new MenuSeparator);
+    menu->addChild(createSubmenuItem("MIDI statistics", "", [=](Menu* menu) {
+      for (std::string line : module->stats.summary()) {
+        menu->addChild(createMenuLabel(line));
+      }
+      menu->addChild(new MenuSeparator);
+      menu->addChild(createMenuItem("Reset statistics", "", [=]() {
+        module->stats.requestReset();
+      }));
+      menu->addChild(createMenuItem("Dump statistics to JSON...", "", [=]() {
+        osdialog_filters *filters = osdialog_filters_parse("JSON (.json):json");
+        char *path = osdialog_file(OSDIALOG_SAVE, asset::user("").c_str(), "nymphes-stats.json", filters);
+        if (path) {
+          module->dumpStats(path);
+          free(path);
+        }
+        osdialog_filters_free(filters);
+      }));
+    }));
+
+    menu->addChild(createBoolPtrMenuItem("Suppress CC echoes", "", &module->midiOutput.echoes.enabled));
+    menu->addChild(createBoolPtrMenuItem("Soft takeover (pickup)", "", &module->softTakeover));
+
+    menu->addChild(createSubmenuItem("Input filter", "", [=](Menu* menu) {
+      struct StatusGroup {
+        const char* name;
+        uint32_t mask;
+      };
+      static const StatusGroup groups[] = {
+        {"Notes", 1 << 0x8 | 1 << 0x9},
+        {"Aftertouch", 1 << 0xa | 1 << 0xd},
+        {"Control change", 1 << 0xb},
+        {"Program change", 1 << 0xc},
+        {"Pitch bend", 1 << 0xe},
+        {"System and clock", 1 << 0xf},
+      };
+      menu->addChild(createMenuLabel("Pass"));
+      for (const StatusGroup& group : groups) {
+        uint32_t mask = group.mask;
+        menu->addChild(createBoolMenuItem(group.name, "", [=]() {
+          return (module->midiInput.statusMask.load() & mask) != 0;
+        }, [=](bool pass) {
+          uint32_t statusMask = module->midiInput.statusMask.load();
+          module->midiInput.statusMask.store(pass ? statusMask | mask : statusMask & ~mask);
+        }));
+      }
+      menu->addChild(new MenuSeparator);
+      menu->addChild(createBoolMenuItem("Learned CCs only", "", [=]() {
+        return module->midiInput.ccWhitelistOnly.load();
+      }, [=](bool only) {
+        module->midiInput.ccWhitelistOnly.store(only);
+      }));
+    }));
+
+    menu->addChild(createBoolPtrMenuItem("Send MIDI clock", module->clockOut.running ? string::f("%.1f BPM", module->clockOut.getBpm()) : "", &module->sendClock));
+    menu->addChild(createIndexPtrSubmenuItem("Clock input PPQN", {"1", "2", "4", "24"}, &module->clockPpqn));
+
+    menu->addChild(createSubmenuItem("Program change timing", "", [=](Menu* menu) {
+      menu->addChild(createIndexPtrSubmenuItem("Send", {"Immediately", "On next beat", "On next bar"}, &module->pcTiming));
+      std::vector<std::string> beats;
+      for (int i = 1; i <= 16; i++)
+        beats.push_back(string::f("%d", i));
+      menu->addChild(createIndexSubmenuItem("Beats per bar", beats, [=]() {
+        return module->beatsPerBar - 1;
+      }, [=](size_t index) {
+        module->beatsPerBar = index + 1;
+      }));
+      if (module->pcPending)
+        menu->addChild(createMenuLabel("Program change waiting"));
+    }));
+
+    menu->addChild(createSubmenuItem("Random modulation", "", [=](Menu* menu) {
+      static const float rates[] = {0.1f, 0.25f, 0.5f, 1.f, 2.f, 4.f, 8.f};
+      menu->addChild(createIndexSubmenuItem("Rate", {"0.1 Hz", "0.25 Hz", "0.5 Hz", "1 Hz", "2 Hz", "4 Hz", "8 Hz"}, [=]() {
+        size_t index = 0;
+        while (index < 6 && rates[index] < module->randomMods.rate) index++;
+        return index;
+      }, [=](size_t index) {
+        module->randomMods.rate = rates[index];
+      }));
+      menu->addChild(createMenuLabel("Sample and hold follows the clock input when patched"));
+      menu->addChild(new MenuSeparator);
+      static const float depths[] = {0.05f, 0.1f, 0.25f, 0.5f, 1.f};
+      static const char *const modeNames[] = {"", "Walk", "S&H"};
+      for (int i = 0; i < 74; i++) {
+        int mode = module->randomMods.mode[i];
+        std::string right = mode ? string::f("%s %d%%", modeNames[mode], (int) std::round(module->randomMods.depth[i] * 100)) : "";
+        menu->addChild(createSubmenuItem(string::f("Slider %d, CC %d", i + 1, module->learnedCcs[NymphesControl::sliderTarget(i)]), right, [=](Menu* menu) {
+          menu->addChild(createIndexPtrSubmenuItem("Mode", {"Off", "Random walk", "Sample and hold"}, &module->randomMods.mode[i]));
+          menu->addChild(createIndexSubmenuItem("Depth", {"5%", "10%", "25%", "50%", "100%"}, [=]() {
+            size_t index = 0;
+            while (index < 4 && depths[index] < module->randomMods.depth[i]) index++;
+            return index;
+          }, [=](size_t index) {
+            module->randomMods.depth[i] = depths[index];
+          }));
+        }));
+      }
+    }));
+
+    menu->addChild(createIndexPtrSubmenuItem("Voice allocation", {"Round robin", "Lowest note priority", "Reuse same note"}, &module->voices.mode));
+    menu->addChild(createBoolPtrMenuItem("One channel per voice (MPE)", "", &module->voiceChannels));
+
+    menu->addChild(createSubmenuItem("MIDI thru", "", [=](Menu* menu) {
+      appendMidiMenu(menu, &module->thruInput);
+    }));
+
+    menu->addChild(createSubmenuItem("External controller", "", [=](Menu* menu) {
+      appendMidiMenu(menu, &module->controllerInput);
+      menu->addChild(new MenuSeparator);
+      int learn = module->remapLearn.load();
+      std::string learnText = learn == NymphesControl::REMAP_WAIT_SLIDER ? "Move a slider..." : learn == NymphesControl::REMAP_WAIT_CC ? "Move a controller knob..." : "";
+      menu->addChild(createMenuItem("Learn mapping", learnText, [=]() {
+        module->remapLearn.store(learn == NymphesControl::REMAP_IDLE ? NymphesControl::REMAP_WAIT_SLIDER : NymphesControl::REMAP_IDLE);
+      }));
+      menu->addChild(createMenuItem("Clear mappings", "", [=]() {
+        module->remap.post(-1, 0, -1);
+      }));
+      for (int c = 0; c < 16; c++) {
+        for (int cc = 0; cc < 128; cc++) {
+          MidiRemap::Entry e = module->remap.table[c][cc];
+          if (e.target < 8 || e.target >= 82)
+            continue;
+          std::string label = string::f("Ch %d CC %d to Nymphes CC %d", c + 1, cc, module->learnedCcs[e.target]);
+          menu->addChild(createSubmenuItem(label, "", [=](Menu* menu) {
+            for (bool high : {false, true}) {
+              RemapRangeSlider* slider = new RemapRangeSlider(module, c, cc, high);
+              slider->box.size.x = 200.f;
+              menu->addChild(slider);
+            }
+            menu->addChild(createBoolMenuItem("Invert", "", [=]() {
+              return module->remap.table[c][cc].max < module->remap.table[c][cc].min;
+            }, [=](bool invert) {
+              MidiRemap::Entry e = module->remap.table[c][cc];
+              if ((e.max < e.min) != invert)
+                module->remap.post(c, cc, e.target, e.max, e.min);
+            }));
+            menu->addChild(createMenuItem("Remove", "", [=]() {
+              module->remap.post(c, cc, -1);
+            }));
+          }));
+        }
+      }
+    }));
+
+    menu->addChild(createSubmenuItem("Patch history", "", [=](Menu* menu) {
+      menu->addChild(createMenuLabel(string::f("Step %u of %u", module->history.position() - module->history.first(), module->history.last() - module->history.first())));
+      menu->addChild(createMenuItem("Undo", "", [=]() {
+        module->historyRequest.store(NymphesControl::HISTORY_UNDO);
+      }));
+      menu->addChild(createMenuItem("Redo", "", [=]() {
+        module->historyRequest.store(NymphesControl::HISTORY_REDO);
+      }));
+      menu->addChild(createSubmenuItem("Go to step", "", [=](Menu* menu) {
+        uint32_t first = module->history.first();
+        uint32_t last = module->history.last();
+        std::vector<uint32_t> targets = {first};
+        for (uint32_t step = first - first % NymphesPatchHistory::KEYFRAME_INTERVAL + NymphesPatchHistory::KEYFRAME_INTERVAL; step < last; step += NymphesPatchHistory::KEYFRAME_INTERVAL) {
+          targets.push_back(step);
+        }
+        if (last > first) {
+          targets.push_back(last);
+        }
+        for (uint32_t step : targets) {
+          std::string name = step == first ? "Oldest" : step == last ? "Latest" : string::f("Step %u", step - first);
+          menu->addChild(createCheckMenuItem(name, "", [=]() {
+            return module->history.position() == step;
+          }, [=]() {
+            module->historyTarget.store(step);
+            module->historyRequest.store(NymphesControl::HISTORY_JUMP);
+          }));
+        }
+      }));
+      menu->addChild(createMenuItem("Clear history", "", [=]() {
+        module->historyRequest.store(NymphesControl::HISTORY_RESTART);
+      }));
+    }));
+
+    menu->addChild(createSubmenuItem("Motion recording", "", [=](Menu* menu) {
+      menu->addChild(createMenuLabel(string::f("%d events", module->motion.numEvents)));
+      menu->addChild(createBoolPtrMenuItem("Record (overdub)", "", &module->motion.recording));
+      menu->addChild(createBoolPtrMenuItem("Play", "", &module->motion.playing));
+      menu->addChild(createMenuItem("Clear", "", [=]() {
+        module->motionClear.store(true);
+      }));
+      std::vector<std::string> lengths = {"1", "2", "4", "8", "16", "32", "64"};
+      menu->addChild(createIndexSubmenuItem("Loop length (beats)", lengths, [=]() {
+        size_t index = 0;
+        while (index < 6 && (1 << index) < module->motion.loopBeats) index++;
+        return index;
+      }, [=](size_t index) {
+        module->motionLoopBeats.store(1 << index);
+      }));
+    }));
+
+    menu->addChild(createSubmenuItem("MIDI recorder", "", [=](Menu* menu) {
+      if (module->recorder.recording) {
+        menu->addChild(createMenuItem("Stop recording", "", [=]() {
+          module->recorder.stop();
+        }));
+      } else {
+        menu->addChild(createMenuItem("Record to MIDI file...", "", [=]() {
+          osdialog_filters *filters = osdialog_filters_parse("MIDI file (.mid):mid");
+          char *path = osdialog_file(OSDIALOG_SAVE, asset::user("").c_str(), "nymphes-traffic.mid", filters);
+          if (path) {
+            std::string pathStr = path;
+            if (system::getExtension(pathStr) != ".mid") {
+              pathStr += ".mid";
+            }
+            module->recorder.start(pathStr, APP->engine->getSampleRate());
+            free(path);
+          }
+          osdialog_filters_free(filters);
+        }));
+      }
+      if (module->recorder.overruns > 0) {
+        menu->addChild(createMenuLabel(string::f("%llu events lost", (unsigned long long)module->recorder.overruns.load())));
+      }
+      menu->addChild(new MenuSeparator);
+      menu->addChild(createMenuItem("Replay MIDI file as input...", "", [=]() {
+        osdialog_filters *filters = osdialog_filters_parse("MIDI file (.mid):mid");
+        char *path = osdialog_file(OSDIALOG_OPEN, asset::user("").c_str(), NULL, filters);
+        if (path) {
+          MidiReplay *r = MidiReplay::load(path, APP->engine->getSampleRate());
+          if (r) {
+            module->replay.publish(r);
+          }
+          free(path);
+        }
+        osdialog_filters_free(filters);
+      }));
+      menu->addChild(createMenuItem("Stop replay", "", [=]() {
+        module->replay.publish(new MidiReplay);
+      }));
+      menu->addChild(createBoolMenuItem("Loop replay", "", [=]() {
+        return module->replayLoop.load();
+      }, [=](bool loop) {
+        module->replayLoop.store(loop);
+      }));
+    }));
+
+    menu->addChild(createSubmenuItem("Trace", "", [=](Menu* menu) {
+      menu->addChild(createMenuLabel(string::f("%u events captured", module->trace.size())));
+      menu->addChild(createMenuItem("Start capture", module->trace.enabled.load() ? "running" : "", [=]() {
+        module->trace.start();
+      }));
+      menu->addChild(createMenuItem("Stop and export Chrome trace...", "", [=]() {
+        module->trace.stop();
+        osdialog_filters *filters = osdialog_filters_parse("Chrome trace (.json):json");
+        char *path = osdialog_file(OSDIALOG_SAVE, asset::user("").c_str(), "nymphes-trace.json", filters);
+        if (path) {
+          module->exportTrace(path);
+          free(path);
+        }
+        osdialog_filters_free(filters);
+      }));
+    }));
+  }
   
 };
 
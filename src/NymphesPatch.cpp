@@ -0,0 +1,318 @@
+#include "NymphesPatch.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+const int NymphesPatch::BUTTON_MAX[NymphesPatch::NUM_BUTTONS] = {3, 3, 3, 1, 1, 1, 1};
+
+bool NymphesPatch::parse(const char *text, size_t length) {
+
+	int values[NUM_VALUES];
+	int count = 0;
+	size_t pos = 0;
+
+	while (pos < length) {
+
+		char c = text[pos];
+
+		// Values are separated by commas and/or whitespace, over any number of lines
+		if (c == ',' || c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+			pos++;
+			continue;
+		}
+
+		if (c < '0' || c > '9') {
+			return false;
+		}
+
+		// Every value fits in 3 digits, which also keeps the accumulator from overflowing
+		int value = 0;
+		int digits = 0;
+		while (pos < length && text[pos] >= '0' && text[pos] <= '9') {
+			if (++digits > 3) {
+				return false;
+			}
+			value = value * 10 + (text[pos] - '0');
+			pos++;
+		}
+
+		if (count == NUM_VALUES) {
+			return false;
+		}
+		values[count++] = value;
+
+	}
+
+	if (count != NUM_VALUES) {
+		return false;
+	}
+
+	// Range check everything before touching the patch. Older versions saved sliders at their top
+	// position as 128, so that is read as 127, and could save button settings and a playmode past
+	// the last one, which are read as the last.
+	int indx = 0;
+	for (int i = 0; i < NUM_CONTROLLERS + NUM_MOD_SOURCES * NUM_MOD_CONTROLLERS; i++) {
+		if (values[indx] > 128) {
+			return false;
+		}
+		values[indx] = std::min(values[indx], 127);
+		indx++;
+	}
+	for (int j = 0; j < NUM_BUTTONS; j++) {
+		values[indx] = std::min(values[indx], BUTTON_MAX[j]);
+		indx++;
+	}
+	values[indx] = std::min(values[indx], (int) PLAYMODE_MAX);
+
+	indx = 0;
+	for (int i = 0; i < NUM_CONTROLLERS; i++) {
+		controllers[i] = values[indx++];
+	}
+	for (int i = 0; i < NUM_MOD_SOURCES; i++) {
+		for (int j = 0; j < NUM_MOD_CONTROLLERS; j++) {
+			mod_values[i][j] = values[indx++];
+		}
+	}
+	for (int j = 0; j < NUM_BUTTONS; j++) {
+		buttons[j] = values[indx++];
+	}
+	playmode = values[indx];
+
+	return true;
+
+}
+
+bool NymphesPatch::load(const std::string &filename) {
+
+	FILE *patchFile = fopen(filename.c_str(), "rb");
+	if (!patchFile) {
+		return false;
+	}
+
+	// Read one byte past the limit so oversized files can be told apart
+	std::vector<char> buffer(MAX_FILE_SIZE + 1);
+	size_t length = fread(buffer.data(), 1, buffer.size(), patchFile);
+	fclose(patchFile);
+
+	if (length > MAX_FILE_SIZE) {
+		return false;
+	}
+
+	return parse(buffer.data(), length);
+
+}
+
+bool NymphesPatch::save(const std::string &filename) const {
+
+	FILE *patchFile = fopen(filename.c_str(), "w");
+	if (!patchFile) {
+		return false;
+	}
+
+	std::string text = format();
+	bool ok = fputs(text.c_str(), patchFile) >= 0;
+	fclose(patchFile);
+
+	return ok;
+
+}
+
+std::string NymphesPatch::format() const {
+
+	std::string text;
+
+	for (int i = 0; i < NUM_CONTROLLERS; i++) {
+		text += std::to_string(controllers[i]) + ", ";
+	}
+	for (int i = 0; i < NUM_MOD_SOURCES; i++) {
+		for (int j = 0; j < NUM_MOD_CONTROLLERS; j++) {
+			text += std::to_string(mod_values[i][j]) + ", ";
+		}
+	}
+	for (int j = 0; j < NUM_BUTTONS; j++) {
+		text += std::to_string(buttons[j]) + ", ";
+	}
+	text += std::to_string(playmode) + "\n";
+
+	return text;
+
+}
+
+int &NymphesPatch::at(int index) {
+	if (index < NUM_CONTROLLERS) {
+		return controllers[index];
+	}
+	index -= NUM_CONTROLLERS;
+	if (index < NUM_MOD_SOURCES * NUM_MOD_CONTROLLERS) {
+		return mod_values[index / NUM_MOD_CONTROLLERS][index % NUM_MOD_CONTROLLERS];
+	}
+	index -= NUM_MOD_SOURCES * NUM_MOD_CONTROLLERS;
+	if (index < NUM_BUTTONS) {
+		return buttons[index];
+	}
+	return playmode;
+}
+
+int NymphesPatch::at(int index) const {
+	return const_cast<NymphesPatch *>(this)->at(index);
+}
+
+void NymphesPatchHistory::reset(const NymphesPatch &state) {
+	for (int i = 0; i < NymphesPatch::NUM_VALUES; i++) {
+		tracked[i] = state.at(i);
+		openSlot[i] = -1;
+	}
+	for (uint32_t k = 0; k < NUM_KEYFRAMES; k++) {
+		keyframes[k].step = UINT32_MAX;
+	}
+	deltaTail = deltaHead = 0;
+	firstStep = lastStep = currentStep = 0;
+	open = false;
+	storeKeyframe();
+}
+
+bool NymphesPatchHistory::track(const NymphesPatch &state) {
+	bool changed = false;
+	for (int i = 0; i < NymphesPatch::NUM_VALUES; i++) {
+		uint8_t value = state.at(i);
+		if (value == tracked[i]) {
+			continue;
+		}
+		if (!open) {
+			beginStep();
+		}
+		if (openSlot[i] >= 0) {
+			deltas[openSlot[i] % MAX_DELTAS].after = value;
+		} else {
+			if (deltaHead - deltaTail == MAX_DELTAS) {
+				dropOldest();
+			}
+			openSlot[i] = deltaHead;
+			Delta &d = deltas[deltaHead % MAX_DELTAS];
+			d.index = i;
+			d.before = tracked[i];
+			d.after = value;
+			deltaHead++;
+			steps[currentStep % MAX_STEPS].count++;
+		}
+		tracked[i] = value;
+		changed = true;
+	}
+	return changed;
+}
+
+void NymphesPatchHistory::close() {
+	if (!open) {
+		return;
+	}
+	open = false;
+	Step &s = steps[currentStep % MAX_STEPS];
+	for (uint32_t d = s.start; d < s.start + s.count; d++) {
+		openSlot[deltas[d % MAX_DELTAS].index] = -1;
+	}
+	currentStep++;
+	lastStep = currentStep;
+	storeKeyframe();
+}
+
+void NymphesPatchHistory::beginStep() {
+	// A new change after undoing throws away the steps that could have been redone
+	if (currentStep < lastStep) {
+		deltaHead = steps[currentStep % MAX_STEPS].start;
+		lastStep = currentStep;
+	}
+	if (lastStep - firstStep == MAX_STEPS) {
+		dropOldest();
+	}
+	Step &s = steps[currentStep % MAX_STEPS];
+	s.start = deltaHead;
+	s.count = 0;
+	open = true;
+}
+
+void NymphesPatchHistory::dropOldest() {
+	if (firstStep == currentStep) {
+		// Only the open step is left, it can't grow past one delta per value so this never happens
+		return;
+	}
+	Step &s = steps[firstStep % MAX_STEPS];
+	deltaTail = s.start + s.count;
+	firstStep++;
+}
+
+void NymphesPatchHistory::storeKeyframe() {
+	if (currentStep % KEYFRAME_INTERVAL != 0) {
+		return;
+	}
+	Keyframe &k = keyframes[(currentStep / KEYFRAME_INTERVAL) % NUM_KEYFRAMES];
+	k.step = currentStep;
+	for (int i = 0; i < NymphesPatch::NUM_VALUES; i++) {
+		k.values[i] = tracked[i];
+	}
+}
+
+void NymphesPatchHistory::applyStep(uint32_t step, bool forward) {
+	const Step &s = steps[step % MAX_STEPS];
+	for (uint32_t d = s.start; d < s.start + s.count; d++) {
+		const Delta &delta = deltas[d % MAX_DELTAS];
+		tracked[delta.index] = forward ? delta.after : delta.before;
+	}
+}
+
+void NymphesPatchHistory::output(NymphesPatch *state) {
+	for (int i = 0; i < NymphesPatch::NUM_VALUES; i++) {
+		state->at(i) = tracked[i];
+	}
+}
+
+bool NymphesPatchHistory::undo(NymphesPatch *state) {
+	close();
+	if (currentStep == firstStep) {
+		return false;
+	}
+	currentStep--;
+	applyStep(currentStep, false);
+	output(state);
+	return true;
+}
+
+bool NymphesPatchHistory::redo(NymphesPatch *state) {
+	close();
+	if (currentStep == lastStep) {
+		return false;
+	}
+	applyStep(currentStep, true);
+	currentStep++;
+	output(state);
+	return true;
+}
+
+bool NymphesPatchHistory::jump(uint32_t step, NymphesPatch *state) {
+	close();
+	if (step < firstStep || step > lastStep) {
+		return false;
+	}
+
+	// Start from the keyframe at or before the target if that is closer than where we are
+	uint32_t base = step - step % KEYFRAME_INTERVAL;
+	const Keyframe &k = keyframes[(base / KEYFRAME_INTERVAL) % NUM_KEYFRAMES];
+	uint32_t distance = step > currentStep ? step - currentStep : currentStep - step;
+	if (k.step == base && base >= firstStep && step - base < distance) {
+		for (int i = 0; i < NymphesPatch::NUM_VALUES; i++) {
+			tracked[i] = k.values[i];
+		}
+		currentStep = base;
+	}
+
+	while (currentStep < step) {
+		applyStep(currentStep, true);
+		currentStep++;
+	}
+	while (currentStep > step) {
+		currentStep--;
+		applyStep(currentStep, false);
+	}
+	output(state);
+	return true;
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Contents of a .nym patch file: the 38 front panel controllers, the 36 modulation amounts for each
+ * of the 4 modulation sources, the 7 button settings and the playmode, as comma separated integers.
+ */
+struct NymphesPatch {
+
+	static const int NUM_CONTROLLERS = 38;
+	static const int NUM_MOD_SOURCES = 4;
+	static const int NUM_MOD_CONTROLLERS = 36;
+	static const int NUM_BUTTONS = 7;
+	static const int NUM_VALUES = NUM_CONTROLLERS + NUM_MOD_SOURCES * NUM_MOD_CONTROLLERS + NUM_BUTTONS + 1;
+
+	// A patch is well under 1kB, so anything larger than this is not a patch file
+	static const size_t MAX_FILE_SIZE = 16384;
+
+	// Highest setting of each button, as cycled through on the panel
+	static const int BUTTON_MAX[NUM_BUTTONS];
+	static const int PLAYMODE_MAX = 5;
+
+	int controllers[NUM_CONTROLLERS] = {};
+	int mod_values[NUM_MOD_SOURCES][NUM_MOD_CONTROLLERS] = {};
+	int buttons[NUM_BUTTONS] = {};
+	int playmode = 0;
+
+	/*
+	 * Parse the text of a patch file. Returns false and leaves the patch untouched unless the text holds
+	 * exactly NUM_VALUES integers of up to 3 digits. Controller values of 128 from older files are read
+	 * as 127, and button settings or a playmode past the last as the last, any other value out of range
+	 * is rejected. Runs in time linear in length and never throws, so it is safe to call on arbitrary
+	 * input.
+	 */
+	bool parse(const char *text, size_t length);
+
+	/*
+	 * Read and parse a patch file, rejecting files larger than MAX_FILE_SIZE.
+	 */
+	bool load(const std::string &filename);
+
+	bool save(const std::string &filename) const;
+
+	std::string format() const;
+
+	/*
+	 * The values in file order, index 0 to NUM_VALUES - 1.
+	 */
+	int &at(int index);
+	int at(int index) const;
+
+};
+
+/*
+ * Bounded undo history of a patch. Each step stores only the values it changed, as (index, before,
+ * after) deltas in a fixed ring, and every KEYFRAME_INTERVAL steps a full copy of the patch is kept
+ * so any point in the history can be reached by replaying at most KEYFRAME_INTERVAL steps. When the
+ * rings are full the oldest steps are dropped, so memory use never grows.
+ */
+struct NymphesPatchHistory {
+
+	static const uint32_t MAX_DELTAS = 8192;
+	static const uint32_t MAX_STEPS = 1024;
+	static const uint32_t KEYFRAME_INTERVAL = 32;
+	static const uint32_t NUM_KEYFRAMES = MAX_STEPS / KEYFRAME_INTERVAL + 1;
+
+	/*
+	 * Forget all history and start tracking from state.
+	 */
+	void reset(const NymphesPatch &state);
+
+	/*
+	 * Record the differences between state and the last tracked state into the open step, starting
+	 * one if needed. Repeated changes of the same value within a step are merged. Return true if
+	 * anything changed.
+	 */
+	bool track(const NymphesPatch &state);
+
+	/*
+	 * Close the open step, later changes start a new one.
+	 */
+	void close();
+
+	/*
+	 * Move through the history, writing the resulting patch to state. Return false at either end.
+	 */
+	bool undo(NymphesPatch *state);
+	bool redo(NymphesPatch *state);
+	bool jump(uint32_t step, NymphesPatch *state);
+
+	// Steps are numbered from the start of the history; the patch is currently at position()
+	uint32_t first() const { return firstStep; }
+	uint32_t last() const { return lastStep; }
+	uint32_t position() const { return currentStep; }
+
+	private:
+
+	struct Delta {
+		uint8_t index;
+		uint8_t before;
+		uint8_t after;
+	};
+
+	struct Step {
+		uint32_t start; // absolute delta number
+		uint32_t count;
+	};
+
+	struct Keyframe {
+		uint32_t step;
+		uint8_t values[NymphesPatch::NUM_VALUES];
+	};
+
+	uint8_t tracked[NymphesPatch::NUM_VALUES] = {};
+	Delta deltas[MAX_DELTAS];
+	Step steps[MAX_STEPS];
+	Keyframe keyframes[NUM_KEYFRAMES];
+	int32_t openSlot[NymphesPatch::NUM_VALUES]; // delta holding each value in the open step
+
+	uint32_t deltaTail = 0;
+	uint32_t deltaHead = 0;
+	uint32_t firstStep = 0;
+	uint32_t lastStep = 0;
+	uint32_t currentStep = 0;
+	bool open = false;
+
+	void beginStep();
+	void dropOldest();
+	void storeKeyframe();
+	void applyStep(uint32_t step, bool forward);
+	void output(NymphesPatch *state);
+
+};
@@ -0,0 +1,315 @@
+#include "Skylander.hpp"
+#include "Core.hpp"
+#include "Handover.hpp"
+
+#include "osdialog.h"
+
+/*
+ * Shows a scale mask as the intervals it contains.
+ */
+struct ScaleMaskQuantity : ParamQuantity {
+	std::string getDisplayValueString() override {
+		int mask = (int) getValue();
+		if (mask == 0) {
+			return "Scale knob";
+		}
+		std::string s;
+		for (int i = 0; i < 12; i++) {
+			if (mask & (1 << i)) {
+				if (!s.empty()) {
+					s += " ";
+				}
+				s += std::string(Core::intervalNames[i]);
+			}
+		}
+		return s;
+	}
+};
+
+struct PolyQuantizer : Module {
+	enum ParamIds {
+		ROOT_PARAM,
+		SCALE_PARAM,
+		MASK_PARAM,
+		HYSTERESIS_PARAM,
+		NUM_PARAMS
+	};
+	enum InputIds {
+		VOCT_INPUT,
+		ROOT_INPUT,
+		SCALE_INPUT,
+		MASK_INPUT,
+		HYSTERESIS_INPUT,
+		NUM_INPUTS
+	};
+	enum OutputIds {
+		VOCT_OUTPUT,
+		NOTE_OUTPUT,
+		DEGREE_OUTPUT,
+		CHANGED_OUTPUT,
+		NUM_OUTPUTS
+	};
+	enum LightIds {
+		NUM_LIGHTS
+	};
+
+	Core core;
+
+	int roots[16] = {};
+	int scales[16] = {};
+	int masks[16] = {};
+	int pitchClasses[16] = {};
+
+	QuantizerHysteresis hysteresis[4];
+	const ScalaTuning *lastTuning = NULL;
+	SkylanderPulseGenerator changedPulses[16];
+
+	// Scala tuning, replaces root, scale and mask while one is loaded. The paths belong to the UI thread.
+	Handover<ScalaTuning> tuning;
+	std::string sclPath;
+	std::string kbmPath;
+	std::string tuningName;
+
+	PolyQuantizer() {
+		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
+		configSwitch(ROOT_PARAM, 0, Core::NUM_NOTES - 1, 0, "Root",
+			std::vector<std::string>(Core::noteNames, Core::noteNames + Core::NUM_NOTES));
+		configSwitch(SCALE_PARAM, 0, Core::NUM_SCALES - 1, 0, "Scale",
+			std::vector<std::string>(Core::scaleNames, Core::scaleNames + Core::NUM_SCALES));
+		configParam<ScaleMaskQuantity>(MASK_PARAM, 0, Core::NUM_SCALE_MASKS - 1, 0, "Scale mask")->snapEnabled = true;
+		configParam(HYSTERESIS_PARAM, 0.f, 1.f, 0.f, "Hysteresis", " semitones");
+		configInput(VOCT_INPUT, "V/OCT");
+		configInput(ROOT_INPUT, "Root");
+		configInput(SCALE_INPUT, "Scale");
+		configInput(MASK_INPUT, "Scale mask");
+		configInput(HYSTERESIS_INPUT, "Hysteresis, 10V adds a semitone");
+		configOutput(VOCT_OUTPUT, "Quantized V/OCT");
+		configOutput(NOTE_OUTPUT, "Note");
+		configOutput(DEGREE_OUTPUT, "Degree");
+		configOutput(CHANGED_OUTPUT, "Note changed trigger");
+	}
+
+	/*
+	 * A poly cable sets every channel, a mono cable or the knob is shared by all of them.
+	 */
+	int getSetting(float volts, int param) {
+		switch (param) {
+			case ROOT_PARAM: return core.getKeyFromVolts(volts);
+			case SCALE_PARAM: return core.getScaleFromVolts(volts);
+			default: return core.getMaskFromVolts(volts);
+		}
+	}
+
+	void updateSetting(int *out, int input, int param, int channels) {
+		if (inputs[input].getChannels() > 1) {
+			for (int c = 0; c < channels; c++) {
+				out[c] = getSetting(inputs[input].getPolyVoltage(c), param);
+			}
+			return;
+		}
+
+		int value = (int) params[param].getValue();
+		if (inputs[input].isConnected()) {
+			value = getSetting(inputs[input].getVoltage(), param);
+		}
+		for (int c = 0; c < channels; c++) {
+			out[c] = value;
+		}
+	}
+
+	/*
+	 * Load sclPath and kbmPath and hand the tuning to the engine, an empty sclPath clears it. UI thread.
+	 */
+	bool loadTuning() {
+		if (sclPath.empty()) {
+			tuningName = "";
+			tuning.publish(new ScalaTuning);
+			return true;
+		}
+		ScalaTuning *t = ScalaTuning::load(sclPath, kbmPath);
+		if (!t) {
+			return false;
+		}
+		tuningName = t->description.empty() ? system::getFilename(sclPath) : t->description;
+		tuning.publish(t);
+		return true;
+	}
+
+	json_t* dataToJson() override {
+		json_t* rootJ = json_object();
+		json_object_set_new(rootJ, "scl", json_string(sclPath.c_str()));
+		json_object_set_new(rootJ, "kbm", json_string(kbmPath.c_str()));
+		return rootJ;
+	}
+
+	void dataFromJson(json_t* rootJ) override {
+		const char *scl = json_string_value(json_object_get(rootJ, "scl"));
+		const char *kbm = json_string_value(json_object_get(rootJ, "kbm"));
+		sclPath = scl ? scl : "";
+		kbmPath = kbm ? kbm : "";
+		if (!loadTuning()) {
+			sclPath = "";
+			loadTuning();
+		}
+	}
+
+	simd::float_4 getPitchFromTuning(const ScalaTuning *t, simd::float_4 in, simd::float_4 *outNote, simd::float_4 *outDegree) {
+		simd::float_4 volts;
+		for (int i = 0; i < 4; i++) {
+			int degree;
+			volts[i] = t->getPitchFromVolts(in[i], &degree);
+			(*outNote)[i] = ((int) std::round(volts[i] * 12.f) % 12 + 12) % 12;
+			(*outDegree)[i] = degree;
+		}
+		return volts;
+	}
+
+	void process(const ProcessArgs& args) override {
+		int channels = std::max(1, inputs[VOCT_INPUT].getChannels());
+
+		const ScalaTuning *t = tuning.acquire();
+		if (t && t->cents.empty()) {
+			t = NULL;
+		}
+
+		updateSetting(roots, ROOT_INPUT, ROOT_PARAM, channels);
+		updateSetting(scales, SCALE_INPUT, SCALE_PARAM, channels);
+		updateSetting(masks, MASK_INPUT, MASK_PARAM, channels);
+
+		// A mask of 0 selects the scale from the scale knob, if any channel has a mask all of them
+		// go through the mask quantizer
+		bool useMasks = false;
+		for (int c = 0; c < channels; c++) {
+			useMasks |= masks[c] != 0;
+		}
+		if (useMasks) {
+			for (int c = 0; c < channels; c++) {
+				if (masks[c] == 0) {
+					masks[c] = core.getScaleMask(scales[c]);
+				}
+			}
+		}
+
+		// A new tuning drops every held note, a tuning can give any pitch class
+		if (t != lastTuning) {
+			for (int i = 0; i < 4; i++) {
+				hysteresis[i].reset();
+			}
+			lastTuning = t;
+		}
+		for (int c = 0; c < channels; c++) {
+			if (t) {
+				pitchClasses[c] = 0xfff;
+			} else {
+				pitchClasses[c] = Core::getPitchClasses(useMasks ? masks[c] : core.getScaleMask(scales[c]), roots[c]);
+			}
+		}
+
+		for (int c = 0; c < channels; c += 4) {
+			simd::float_4 note;
+			simd::float_4 degree;
+			simd::float_4 in = inputs[VOCT_INPUT].getVoltageSimd<simd::float_4>(c);
+			simd::float_4 volts;
+			if (t) {
+				volts = getPitchFromTuning(t, in, &note, &degree);
+			} else if (useMasks) {
+				volts = core.getPitchFromMask(in, roots + c, masks + c, &note, &degree);
+			} else {
+				volts = core.getPitchFromVolts(in, roots + c, scales + c, &note, &degree);
+			}
+
+			simd::float_4 width = simd::clamp(params[HYSTERESIS_PARAM].getValue() + inputs[HYSTERESIS_INPUT].getPolyVoltageSimd<simd::float_4>(c) * 0.1f, 0.f, 1.f) * Core::SEMITONE;
+			int changed = simd::movemask(hysteresis[c / 4].process(in, width, pitchClasses + c, &volts, &note, &degree));
+			for (int i = 0; i < 4; i++) {
+				if (changed & (1 << i)) {
+					changedPulses[c + i].trigger(Core::TRIGGER);
+				}
+				outputs[CHANGED_OUTPUT].setVoltage(changedPulses[c + i].process(args.sampleTime) ? 10.f : 0.f, c + i);
+			}
+
+			outputs[VOCT_OUTPUT].setVoltageSimd(volts, c);
+			outputs[NOTE_OUTPUT].setVoltageSimd(note * Core::SEMITONE, c);
+			outputs[DEGREE_OUTPUT].setVoltageSimd(degree * Core::SEMITONE, c);
+		}
+
+		outputs[VOCT_OUTPUT].setChannels(channels);
+		outputs[NOTE_OUTPUT].setChannels(channels);
+		outputs[DEGREE_OUTPUT].setChannels(channels);
+		outputs[CHANGED_OUTPUT].setChannels(channels);
+	}
+};
+
+struct PolyQuantizerWidget : ModuleWidget {
+  PolyQuantizerWidget(PolyQuantizer* module) {
+    setModule(module);
+    setPanel(APP->window->loadSvg(asset::plugin(pluginInstance, "res/PolyQuantizer.svg")));
+
+    addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, 0)));
+    addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, 0)));
+    addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+    addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+
+    addParam(createParamCentered<RoundBlackSnapKnob>(mm2px(Vec(7.62, 22.0)), module, PolyQuantizer::ROOT_PARAM));
+    addParam(createParamCentered<RoundBlackSnapKnob>(mm2px(Vec(7.62, 44.0)), module, PolyQuantizer::SCALE_PARAM));
+
+    addInput(createInputCentered<PJ301MPort>(mm2px(Vec(7.62, 32.0)), module, PolyQuantizer::ROOT_INPUT));
+    addInput(createInputCentered<PJ301MPort>(mm2px(Vec(7.62, 54.0)), module, PolyQuantizer::SCALE_INPUT));
+
+    addParam(createParamCentered<RoundBlackKnob>(mm2px(Vec(22.86, 22.0)), module, PolyQuantizer::MASK_PARAM));
+    addInput(createInputCentered<PJ301MPort>(mm2px(Vec(22.86, 32.0)), module, PolyQuantizer::MASK_INPUT));
+
+    addParam(createParamCentered<RoundBlackKnob>(mm2px(Vec(22.86, 44.0)), module, PolyQuantizer::HYSTERESIS_PARAM));
+    addInput(createInputCentered<PJ301MPort>(mm2px(Vec(22.86, 54.0)), module, PolyQuantizer::HYSTERESIS_INPUT));
+    addInput(createInputCentered<PJ301MPort>(mm2px(Vec(7.62, 68.0)), module, PolyQuantizer::VOCT_INPUT));
+
+    addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(7.62, 86.0)), module, PolyQuantizer::VOCT_OUTPUT));
+    addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(7.62, 97.0)), module, PolyQuantizer::NOTE_OUTPUT));
+    addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(7.62, 108.0)), module, PolyQuantizer::DEGREE_OUTPUT));
+    addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(22.86, 108.0)), module, PolyQuantizer::CHANGED_OUTPUT));
+  }
+
+  void appendContextMenu(Menu* menu) override {
+    PolyQuantizer* module = dynamic_cast<PolyQuantizer*>(this->module);
+    if (!module)
+      return;
+
+    menu->addChild(new MenuSeparator);
+    menu->addChild(createMenuLabel(module->sclPath.empty() ? "Tuning: 12-TET scales" : "Tuning: " + module->tuningName));
+    menu->addChild(createMenuItem("Load Scala scale (.scl)...", "", [=]() {
+      osdialog_filters *filters = osdialog_filters_parse("Scala scale (.scl):scl");
+      char *path = osdialog_file(OSDIALOG_OPEN, asset::user("").c_str(), NULL, filters);
+      if (path) {
+        std::string previous = module->sclPath;
+        module->sclPath = path;
+        if (!module->loadTuning()) {
+          module->sclPath = previous;
+        }
+        free(path);
+      }
+      osdialog_filters_free(filters);
+    }));
+    menu->addChild(createMenuItem("Load keyboard mapping (.kbm)...", module->kbmPath.empty() ? "" : system::getFilename(module->kbmPath), [=]() {
+      osdialog_filters *filters = osdialog_filters_parse("Scala keyboard mapping (.kbm):kbm");
+      char *path = osdialog_file(OSDIALOG_OPEN, asset::user("").c_str(), NULL, filters);
+      if (path) {
+        std::string previous = module->kbmPath;
+        module->kbmPath = path;
+        if (!module->loadTuning()) {
+          module->kbmPath = previous;
+        }
+        free(path);
+      }
+      osdialog_filters_free(filters);
+    }));
+    menu->addChild(createMenuItem("Clear keyboard mapping", "", [=]() {
+      module->kbmPath = "";
+      module->loadTuning();
+    }, module->kbmPath.empty()));
+    menu->addChild(createMenuItem("Clear tuning", "", [=]() {
+      module->sclPath = "";
+      module->loadTuning();
+    }, module->sclPath.empty()));
+  }
+};
+
+Model* modelPolyQuantizer = createModel<PolyQuantizer, PolyQuantizerWidget>("PolyQuantizer");
@@ -7,6 +7,8 @@ void init(Plugin *p) {
 	pluginInstance = p;
 	// Add all Models defined throughout the pluginInstance
 	p->addModel(modelNymphesControl);
+	p->addModel(modelPolyQuantizer);
+	p->addModel(modelChordRecognizer);
 
 	// Any other pluginInstance initialization may go here.
 	// As an alternative, consider lazy-loading assets and lookup tables when your module is created to reduce startup times of Rack.
@@ -13,4 +13,6 @@ extern Model *modelShepardCV;
 extern Model *modelShepardAudio;
 extern Model *modelBitSampleCrush;
 extern Model *modelNymphesControl;
+extern Model *modelPolyQuantizer;
+extern Model *modelChordRecognizer;
 
@@ -0,0 +1,81 @@
+#include "Core.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+/*
+ * Several engine threads each with their own Core, as PolyQuantizer and ChordRecognizer have. The
+ * threads construct their Cores at the same moment, so the shared tables are first built while all
+ * of them wait on it, then quantize, look up chords and draw random numbers. Built with
+ * -fsanitize=thread, any data race fails the run, and every thread must get the same results as one
+ * Core on its own.
+ */
+
+static const int THREADS = 8;
+static const int ROUNDS = 20000;
+
+static std::atomic<int> ready{0};
+
+static uint64_t work(Core &core) {
+	core.seed(1);
+	uint64_t sum = 0;
+	int roots[4], scales[4], masks[4];
+	for (int n = 0; n < ROUNDS; n++) {
+		float in = (n % 9600) / 960.f - 5.f;
+		int note, degree;
+		float out = core.getPitchFromVolts(in, n % 12, n % Core::NUM_SCALES, &note, &degree);
+		sum = sum * 31 + (int64_t) (out * 1200.f) + note * 13 + degree;
+
+		out = core.getPitchFromMask(in, n % 12, n % Core::NUM_SCALE_MASKS, &note, &degree);
+		sum = sum * 31 + (int64_t) (out * 1200.f) + note * 13 + degree;
+
+		for (int i = 0; i < 4; i++) {
+			roots[i] = (n + i) % 12;
+			scales[i] = (n + i) % Core::NUM_SCALES;
+			masks[i] = (n * 7 + i) % Core::NUM_SCALE_MASKS;
+		}
+		simd::float_4 notes, degrees;
+		simd::float_4 out4 = core.getPitchFromVolts(simd::float_4(in, in + 0.1f, in + 0.2f, in + 0.3f), roots, scales, &notes, &degrees);
+		sum = sum * 31 + (int64_t) (out4[3] * 1200.f) + (int) notes[3];
+		out4 = core.getPitchFromMask(simd::float_4(in, in + 0.1f, in + 0.2f, in + 0.3f), roots, masks, &notes, &degrees);
+		sum = sum * 31 + (int64_t) (out4[3] * 1200.f) + (int) notes[3];
+
+		int root, inversion;
+		int chord = core.getChordFromMask(n % Core::NUM_SCALE_MASKS, n % 12, &root, &inversion);
+		sum = sum * 31 + chord * 144 + root * 12 + inversion;
+
+		sum = sum * 31 + (int64_t) (core.rng.normal() * 1e6f);
+		sum = sum * 31 + (int64_t) (core.rng.normal4()[2] * 1e6f);
+	}
+	return sum;
+}
+
+int main() {
+	std::vector<uint64_t> sums(THREADS);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < THREADS; t++) {
+		threads.emplace_back([t, &sums]() {
+			ready++;
+			while (ready.load() < THREADS) {
+			}
+			Core core;
+			sums[t] = work(core);
+		});
+	}
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+
+	Core core;
+	uint64_t expected = work(core);
+	for (int t = 0; t < THREADS; t++) {
+		if (sums[t] != expected) {
+			printf("core_threads: thread %d got %llx, expected %llx\n", t, (unsigned long long) sums[t], (unsigned long long) expected);
+			return 1;
+		}
+	}
+	printf("core_threads: %d threads agree\n", THREADS);
+	return 0;
+}
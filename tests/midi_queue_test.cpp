@@ -0,0 +1,107 @@
+#include "MidiTools.hpp"
+
+#include <cstdio>
+
+/*
+ * MidiOutputQueue only updates a waiting CC in place when the waiting message is the same CC on the
+ * same channel, and never merges bank select across the program change after it.
+ */
+
+static int failures = 0;
+
+static midi::Message cc(int channel, int cc, int value) {
+	midi::Message m;
+	m.setStatus(0xb);
+	m.setChannel(channel);
+	m.setNote(cc);
+	m.setValue(value);
+	return m;
+}
+
+static midi::Message programChange(int channel, int program) {
+	midi::Message m;
+	m.setSize(2);
+	m.setStatus(0xc);
+	m.setChannel(channel);
+	m.setNote(program);
+	return m;
+}
+
+static std::string describe(const midi::Message &m) {
+	char s[32];
+	if (m.getStatus() == 0xc) {
+		snprintf(s, sizeof(s), "ch %d pc %d", m.getChannel(), m.getNote());
+	} else {
+		snprintf(s, sizeof(s), "ch %d cc %d val %d", m.getChannel(), m.getNote(), m.getValue());
+	}
+	return s;
+}
+
+static std::vector<std::string> drain(MidiOutputQueue &queue) {
+	std::vector<std::string> sent;
+	while (!queue.empty()) {
+		queue.process(1.f, [&](const midi::Message &m) {
+			sent.push_back(describe(m));
+		});
+	}
+	return sent;
+}
+
+static void expect(const char *name, const std::vector<std::string> &sent, const std::vector<std::string> &expected) {
+	bool ok = sent == expected;
+	printf("%-36s %s\n", name, ok ? "ok" : "FAILED");
+	if (!ok) {
+		for (const std::string &s : sent) {
+			printf("  sent %s\n", s.c_str());
+		}
+		failures++;
+	}
+}
+
+int main() {
+	MidiOutputQueue queue;
+
+	queue.pushLow(cc(0, 5, 10));
+	queue.pushLow(cc(0, 7, 20));
+	expect("different CCs after clear", drain(queue), {"ch 0 cc 5 val 10", "ch 0 cc 7 val 20"});
+
+	queue.clear();
+	queue.pushLow(cc(0, 1, 10));
+	queue.pushLow(cc(3, 1, 20));
+	queue.pushLow(cc(0, 2, 30));
+	queue.pushLow(cc(0, 1, 11));
+	queue.pushLow(cc(3, 1, 21));
+	expect("same CC on two channels", drain(queue), {"ch 0 cc 1 val 11", "ch 3 cc 1 val 21", "ch 0 cc 2 val 30"});
+
+	queue.clear();
+	queue.pushLow(cc(0, 0, 1));
+	queue.pushLow(cc(0, 32, 0));
+	queue.pushLow(programChange(0, 5));
+	queue.pushLow(cc(0, 0, 2));
+	queue.pushLow(cc(0, 32, 0));
+	queue.pushLow(programChange(0, 6));
+	expect("bank select stays before its PC", drain(queue),
+		{"ch 0 cc 0 val 1", "ch 0 cc 32 val 0", "ch 0 pc 5", "ch 0 cc 0 val 2", "ch 0 cc 32 val 0", "ch 0 pc 6"});
+
+	// Walk the FIFO around several times so every remembered position is stale
+	queue.clear();
+	for (int n = 0; n < 3 * (int) MidiOutputQueue::CAPACITY; n++) {
+		queue.pushLow(cc(n % 16, n % 120 + 1, n % 128));
+		drain(queue);
+	}
+	std::vector<std::string> expected;
+	for (int n = 0; n < 48; n++) {
+		queue.pushLow(cc(n % 4, 1 + n % 12, n));
+	}
+	// Twelve keys, each sent once with its last value, in the order they were first queued
+	for (int n = 36; n < 48; n++) {
+		expected.push_back(describe(cc(n % 4, 1 + n % 12, n)));
+	}
+	expect("stale positions after wrapping", drain(queue), expected);
+
+	if (failures) {
+		printf("midi_queue_test: %d checks failed\n", failures);
+		return 1;
+	}
+	return 0;
+}
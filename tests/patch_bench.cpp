@@ -0,0 +1,48 @@
+#include "NymphesPatch.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+/*
+ * Parse throughput of valid .nym text, of a file only rejected at its last value, and of a file padded
+ * with whitespace up to the load() size limit.
+ */
+static double measure(const std::string &text, int iterations, bool expect) {
+	auto start = std::chrono::steady_clock::now();
+	for (int n = 0; n < iterations; n++) {
+		NymphesPatch patch;
+		if (patch.parse(text.data(), text.size()) != expect) {
+			printf("patch_bench: unexpected parse result\n");
+			exit(1);
+		}
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+int main() {
+	NymphesPatch patch;
+	for (int i = 0; i < NymphesPatch::NUM_VALUES - NymphesPatch::NUM_BUTTONS - 1; i++) {
+		patch.at(i) = (i * 37) % 128;
+	}
+	std::string valid = patch.format();
+	std::string invalid = valid.substr(0, valid.size() - 2) + "9\n";
+	std::string padded(NymphesPatch::MAX_FILE_SIZE - valid.size(), ' ');
+	padded += valid;
+
+	int iterations = 200000;
+	double seconds = measure(valid, iterations, true);
+	printf("valid:     %zu bytes, %.0f patches/s, %.1f MB/s\n", valid.size(),
+		iterations / seconds, iterations * valid.size() / seconds / 1e6);
+
+	seconds = measure(invalid, iterations, false);
+	printf("invalid:   %zu bytes, %.0f patches/s\n", invalid.size(), iterations / seconds);
+
+	iterations = 20000;
+	seconds = measure(padded, iterations, true);
+	printf("padded:    %zu bytes, %.0f patches/s, %.1f MB/s\n", padded.size(),
+		iterations / seconds, iterations * padded.size() / seconds / 1e6);
+	return 0;
+}
@@ -0,0 +1,93 @@
+#include "NymphesPatch.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+
+/*
+ * NymphesPatch::parse must accept or reject any input without reading out of bounds or throwing, and
+ * a patch it accepts must come back unchanged through format().
+ */
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	NymphesPatch patch;
+	if (!patch.parse((const char *) data, size)) {
+		return 0;
+	}
+
+	for (int i = 0; i < NymphesPatch::NUM_VALUES; i++) {
+		if (patch.at(i) < 0 || patch.at(i) > 127) {
+			abort();
+		}
+	}
+
+	std::string text = patch.format();
+	NymphesPatch again;
+	if (!again.parse(text.data(), text.size()) || again.format() != text) {
+		abort();
+	}
+	return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+
+/*
+ * Without libFuzzer, feed the target a fixed number of random inputs and mutations of a valid patch so
+ * the check runs with any compiler.
+ */
+int main(int argc, char **argv) {
+	int iterations = argc > 1 ? atoi(argv[1]) : 200000;
+	std::mt19937 rng(1);
+
+	NymphesPatch valid;
+	for (int i = 0; i < NymphesPatch::NUM_VALUES; i++) {
+		valid.at(i) = i < NymphesPatch::NUM_VALUES - NymphesPatch::NUM_BUTTONS - 1 ? rng() % 129 : 0;
+	}
+	std::string seed = valid.format();
+
+	const char alphabet[] = "0123456789012345678, ,\n\r\t-+x1289";
+	int accepted = 0;
+
+	for (int n = 0; n < iterations; n++) {
+		std::string input;
+		switch (rng() % 3) {
+			case 0: {
+				// Random bytes, mostly from the characters a patch is made of
+				size_t length = rng() % 2048;
+				for (size_t i = 0; i < length; i++) {
+					input += rng() % 4 ? alphabet[rng() % (sizeof(alphabet) - 1)] : (char) rng();
+				}
+				break;
+			}
+			default: {
+				// A valid patch with a few bytes changed, inserted or removed
+				input = seed;
+				int edits = 1 + rng() % 4;
+				for (int e = 0; e < edits && !input.empty(); e++) {
+					size_t pos = rng() % input.size();
+					switch (rng() % 3) {
+						case 0: input[pos] = alphabet[rng() % (sizeof(alphabet) - 1)]; break;
+						case 1: input.insert(pos, 1, alphabet[rng() % (sizeof(alphabet) - 1)]); break;
+						default: input.erase(pos, 1 + rng() % 4); break;
+					}
+				}
+				break;
+			}
+		}
+
+		// Copy to an exact size buffer so the sanitizer sees any read past the end
+		uint8_t *data = (uint8_t *) malloc(input.size() + 1);
+		memcpy(data, input.data(), input.size());
+		LLVMFuzzerTestOneInput(data, input.size());
+
+		NymphesPatch patch;
+		accepted += patch.parse((const char *) data, input.size());
+		free(data);
+	}
+
+	printf("patch_fuzz: %d inputs, %d accepted\n", iterations, accepted);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,66 @@
+#include "NymphesPatch.hpp"
+
+#include <cstdio>
+#include <string>
+
+/*
+ * Patches saved with button settings or a playmode past the last one, as an incoming CC can leave
+ * them, must load again with those values at their last setting and everything else unchanged.
+ */
+
+static int failures = 0;
+
+static void expect(const char *name, bool ok) {
+	printf("%-40s %s\n", name, ok ? "ok" : "FAILED");
+	failures += !ok;
+}
+
+int main() {
+	std::string filename = std::string(P_tmpdir) + "/patch_test.nym";
+
+	NymphesPatch patch;
+	for (int i = 0; i < NymphesPatch::NUM_VALUES; i++) {
+		patch.at(i) = i % 128;
+	}
+	const int buttons[NymphesPatch::NUM_BUTTONS] = {127, 4, 3, 2, 64, 1, 0};
+	for (int j = 0; j < NymphesPatch::NUM_BUTTONS; j++) {
+		patch.buttons[j] = buttons[j];
+	}
+	patch.playmode = 9;
+
+	expect("save", patch.save(filename));
+	NymphesPatch loaded;
+	expect("load out of range buttons", loaded.load(filename));
+
+	const NymphesPatch &result = loaded;
+	bool same = true;
+	for (int i = 0; i < NymphesPatch::NUM_CONTROLLERS + NymphesPatch::NUM_MOD_SOURCES * NymphesPatch::NUM_MOD_CONTROLLERS; i++) {
+		same &= result.at(i) == patch.at(i);
+	}
+	expect("controllers and mod values unchanged", same);
+
+	bool clamped = true;
+	for (int j = 0; j < NymphesPatch::NUM_BUTTONS; j++) {
+		clamped &= result.buttons[j] == std::min(buttons[j], NymphesPatch::BUTTON_MAX[j]);
+	}
+	expect("buttons at their last setting", clamped);
+	expect("playmode at the last one", result.playmode == NymphesPatch::PLAYMODE_MAX);
+
+	// Saved again, the clamped patch comes back exactly
+	expect("save clamped", loaded.save(filename));
+	NymphesPatch again;
+	expect("round trip", again.load(filename) && again.format() == loaded.format());
+
+	// Controllers are still range checked
+	std::string text = loaded.format();
+	text.replace(0, text.find(','), "129");
+	expect("controller of 129 rejected", !again.parse(text.data(), text.size()));
+
+	remove(filename.c_str());
+
+	if (failures) {
+		printf("patch_test: %d checks failed\n", failures);
+		return 1;
+	}
+	return 0;
+}
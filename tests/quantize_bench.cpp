@@ -0,0 +1,140 @@
+#include "Core.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+/*
+ * The scale walk Core::getPitchFromVolts used before the quantize tables, kept to check the tables
+ * against and to compare their speed.
+ */
+static float legacyPitchFromVolts(float inVolts, int currRoot, int currScale, int *outNote, int *outDegree) {
+	const int *curScaleArr;
+	int notesInScale = 0;
+	Core::getScaleNotes(currScale, &curScaleArr, &notesInScale);
+
+	int octave = floor(inVolts);
+	float closestVal = 10.0;
+	float closestDist = 10.0;
+	int noteFound = 0;
+
+	float octaveOffset = 0;
+	if (currRoot != 0) {
+		octaveOffset = (12 - currRoot) / 12.0;
+	}
+
+	float fOctave = (float)octave - octaveOffset;
+	int scaleIndex = 0;
+	int searchOctave = 0;
+
+	do {
+		int degree = curScaleArr[scaleIndex];
+		float fVoltsAboveOctave = searchOctave + degree / 12.0;
+		float fScaleNoteInVolts = fOctave + fVoltsAboveOctave;
+		float distAway = fabs(inVolts - fScaleNoteInVolts);
+
+		if (distAway >= closestDist){
+			break;
+		} else {
+			closestVal = fScaleNoteInVolts;
+			closestDist = distAway;
+		}
+
+		scaleIndex++;
+
+		if (scaleIndex == notesInScale - 1) {
+			scaleIndex = 0;
+			searchOctave++;
+		}
+
+	} while (true);
+
+	if(scaleIndex == 0) {
+		noteFound = notesInScale - 2;
+	} else {
+		noteFound = scaleIndex - 1;
+	}
+
+	*outNote = (currRoot + curScaleArr[noteFound]) % 12;
+	*outDegree = curScaleArr[noteFound];
+
+	return closestVal;
+}
+
+/*
+ * Every input of a fine sweep must quantize to the same note as the scale walk. The only exception
+ * allowed is an input within float rounding of the midpoint between two notes, where either note is
+ * as near.
+ */
+static int check(Core &core) {
+	int mismatches = 0;
+	int ties = 0;
+	for (int scale = 0; scale < Core::NUM_SCALES; scale++) {
+		for (int root = 0; root < 12; root++) {
+			for (int i = -4 * 960; i <= 4 * 960; i++) {
+				float in = i / 960.f;
+				int note, degree, legacyNote, legacyDegree;
+				float out = core.getPitchFromVolts(in, root, scale, &note, &degree);
+				float legacy = legacyPitchFromVolts(in, root, scale, &legacyNote, &legacyDegree);
+				if (std::fabs(out - legacy) < 1e-5f && note == legacyNote && degree == legacyDegree) {
+					continue;
+				}
+				if (std::fabs(std::fabs(in - out) - std::fabs(in - legacy)) < 1e-5f) {
+					ties++;
+					continue;
+				}
+				if (mismatches++ < 10) {
+					printf("quantize_bench: scale %d root %d in %f: %f (%d %d) against %f (%d %d)\n",
+						scale, root, in, out, note, degree, legacy, legacyNote, legacyDegree);
+				}
+			}
+		}
+	}
+	printf("checked against the scale walk, %d inputs on a midpoint\n", ties);
+	return mismatches;
+}
+
+int main() {
+	Core core;
+	if (check(core)) {
+		return 1;
+	}
+
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> volts(-5.f, 5.f);
+	const int N = 1 << 16;
+	std::vector<float> inputs(N);
+	std::vector<int> roots(N), scales(N);
+	for (int i = 0; i < N; i++) {
+		inputs[i] = volts(rng);
+		roots[i] = rng() % 12;
+		scales[i] = rng() % Core::NUM_SCALES;
+	}
+
+	const int rounds = 100;
+	volatile float sink = 0.f;
+	int note, degree;
+
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < N; i++) {
+			sink = sink + legacyPitchFromVolts(inputs[i], roots[i], scales[i], &note, &degree);
+		}
+	}
+	std::chrono::duration<double> legacy = std::chrono::steady_clock::now() - start;
+
+	start = std::chrono::steady_clock::now();
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < N; i++) {
+			sink = sink + core.getPitchFromVolts(inputs[i], roots[i], scales[i], &note, &degree);
+		}
+	}
+	std::chrono::duration<double> table = std::chrono::steady_clock::now() - start;
+
+	double calls = (double) rounds * N;
+	printf("scale walk: %.1f ns per note\n", legacy.count() / calls * 1e9);
+	printf("table:      %.1f ns per note\n", table.count() / calls * 1e9);
+	return 0;
+}
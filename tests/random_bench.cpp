@@ -0,0 +1,50 @@
+#include "Core.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+/*
+ * Samples per second of each RandomGenerator form, against the Box-Muller over rand() that
+ * Core::gaussrand() used before.
+ */
+
+static double legacyGaussrand() {
+	static double U, V;
+	static int phase = 0;
+	double Z;
+
+	if(phase == 0) {
+		U = (rand() + 1.) / (RAND_MAX + 2.);
+		V = rand() / (RAND_MAX + 1.);
+		Z = sqrt(-2 * log(U)) * sin(2 * M_PI * V);
+	} else
+		Z = sqrt(-2 * log(U)) * cos(2 * M_PI * V);
+
+	phase = 1 - phase;
+
+	return Z;
+}
+
+template <typename F>
+static void measure(const char *name, int samplesPerCall, F f) {
+	const int calls = 1 << 24;
+	volatile float sink = 0.f;
+	auto start = std::chrono::steady_clock::now();
+	for (int n = 0; n < calls; n++) {
+		sink = sink + f();
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	printf("%-20s %6.1f M samples/s\n", name, (double) calls * samplesPerCall / elapsed.count() / 1e6);
+}
+
+int main() {
+	RandomGenerator rng(1);
+	measure("Box-Muller rand()", 1, []() { return (float) legacyGaussrand(); });
+	measure("normal()", 1, [&]() { return rng.normal(); });
+	measure("normal4()", 4, [&]() { return rng.normal4()[0]; });
+	measure("uniform()", 1, [&]() { return rng.uniform(); });
+	measure("uniform4()", 4, [&]() { return rng.uniform4()[0]; });
+	return 0;
+}
@@ -0,0 +1,147 @@
+#include "Core.hpp"
+
+#include <cmath>
+#include <cstdio>
+
+/*
+ * Statistical checks of RandomGenerator with a fixed seed for each form, so a run either always
+ * passes or always fails. Moments are compared with their standard error over N samples and must be
+ * within LIMIT of it.
+ */
+
+static const int N = 1 << 24;
+static const double LIMIT = 5.0;
+
+static int failures = 0;
+
+static void expect(const char *name, double value, double mean, double se) {
+	double z = (value - mean) / se;
+	bool ok = std::fabs(z) < LIMIT;
+	printf("%-28s %10.6f  expected %9.6f  z %6.2f%s\n", name, value, mean, z, ok ? "" : "  FAILED");
+	failures += !ok;
+}
+
+struct Moments {
+	double sum[5] = {};
+	long tail = 0;
+
+	void add(double x) {
+		double p = 1.0;
+		for (int k = 1; k <= 4; k++) {
+			p *= x;
+			sum[k] += p;
+		}
+		tail += std::fabs(x) > 3.442620;
+	}
+
+	// Raw moments of a standard normal are 0, 1, 0 and 3, their variances 1, 2, 15 and 96
+	void check(const char *name) {
+		char label[64];
+		const double mean[5] = {0, 0, 1, 0, 3};
+		const double var[5] = {0, 1, 2, 15, 96};
+		const char *names[5] = {"", "mean", "variance", "third moment", "fourth moment"};
+		for (int k = 1; k <= 4; k++) {
+			snprintf(label, sizeof(label), "%s %s", name, names[k]);
+			expect(label, sum[k] / N, mean[k], std::sqrt(var[k] / N));
+		}
+		double p = std::erfc(3.442620 / std::sqrt(2.0));
+		snprintf(label, sizeof(label), "%s tail beyond r", name);
+		expect(label, (double) tail / N, p, std::sqrt(p * (1 - p) / N));
+	}
+};
+
+/*
+ * Chi-square over 256 equal bins, 255 degrees of freedom, compared as a normal with mean 255 and
+ * variance 510.
+ */
+struct Histogram {
+	static const int BINS = 256;
+	long count[BINS] = {};
+	bool inRange = true;
+
+	void add(float x) {
+		inRange &= x >= 0.f && x < 1.f;
+		count[std::min((int) (x * BINS), BINS - 1)]++;
+	}
+
+	void check(const char *name) {
+		double expected = (double) N / BINS;
+		double chi2 = 0.0;
+		for (int i = 0; i < BINS; i++) {
+			chi2 += (count[i] - expected) * (count[i] - expected) / expected;
+		}
+		char label[64];
+		snprintf(label, sizeof(label), "%s chi-square", name);
+		expect(label, chi2, BINS - 1, std::sqrt(2.0 * (BINS - 1)));
+		if (!inRange) {
+			printf("%s outside [0, 1)  FAILED\n", name);
+			failures++;
+		}
+	}
+};
+
+int main() {
+	RandomGenerator rng(1);
+
+	Moments normal;
+	for (int n = 0; n < N; n++) {
+		normal.add(rng.normal());
+	}
+	normal.check("normal()");
+
+	rng.seed(2);
+	// Lanes are checked separately, and lane 0 against lane 1 for correlation
+	Moments normal4[4];
+	double cross = 0.0;
+	for (int n = 0; n < N; n++) {
+		simd::float_4 x = rng.normal4();
+		for (int lane = 0; lane < 4; lane++) {
+			normal4[lane].add(x[lane]);
+		}
+		cross += (double) x[0] * x[1];
+	}
+	const char *laneNames[4] = {"normal4() lane 0", "normal4() lane 1", "normal4() lane 2", "normal4() lane 3"};
+	for (int lane = 0; lane < 4; lane++) {
+		normal4[lane].check(laneNames[lane]);
+	}
+	expect("normal4() lanes 0 and 1", cross / N, 0.0, std::sqrt(1.0 / N));
+
+	rng.seed(3);
+	Histogram uniform;
+	for (int n = 0; n < N; n++) {
+		uniform.add(rng.uniform());
+	}
+	uniform.check("uniform()");
+
+	rng.seed(4);
+	Histogram uniform4;
+	for (int n = 0; n < N / 4; n++) {
+		simd::float_4 x = rng.uniform4();
+		for (int lane = 0; lane < 4; lane++) {
+			uniform4.add(x[lane]);
+		}
+	}
+	uniform4.check("uniform4()");
+
+	// The same seed gives the same sequence, a different one does not
+	RandomGenerator a(42), b(42), c(43);
+	bool same = true;
+	bool different = false;
+	for (int n = 0; n < 1000; n++) {
+		float x = a.normal(), y = b.normal(), z = c.normal();
+		simd::float_4 x4 = a.uniform4(), y4 = b.uniform4(), z4 = c.uniform4();
+		same &= x == y && x4[0] == y4[0] && x4[3] == y4[3];
+		different |= x != z || x4[0] != z4[0];
+	}
+	a.seed(7);
+	b.seed(7);
+	same &= a.u64() == b.u64();
+	printf("%-28s %s\n", "seeding", same && different ? "reproducible" : "FAILED");
+	failures += !(same && different);
+
+	if (failures) {
+		printf("random_test: %d checks failed\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,227 @@
+#pragma once
+
+/*
+ * The few parts of the Rack SDK that Core and the header-only helpers of MidiTools.hpp use, so they
+ * build without Rack. Only for the checks and benchmarks in tests/, the plugin always builds against
+ * the real SDK.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#define LENGTHOF(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+struct json_t;
+
+namespace rack {
+
+struct Plugin;
+struct Model;
+
+inline int clamp(int x, int a, int b) {
+	return std::max(std::min(x, b), a);
+}
+
+inline float clamp(float x, float a = 0.f, float b = 1.f) {
+	return std::fmax(std::fmin(x, b), a);
+}
+
+inline float rescale(float x, float xMin, float xMax, float yMin, float yMax) {
+	return yMin + (x - xMin) / (xMax - xMin) * (yMax - yMin);
+}
+
+namespace random {
+
+inline uint64_t u64() {
+	thread_local std::mt19937_64 rng(std::random_device{}());
+	return rng();
+}
+
+}
+
+namespace simd {
+
+/*
+ * Plain four float vector, comparisons return lanes with all bits set like the SSE version.
+ */
+struct float_4 {
+	float s[4];
+
+	float_4() = default;
+
+	float_4(float x) {
+		for (int i = 0; i < 4; i++) s[i] = x;
+	}
+
+	float_4(float a, float b, float c, float d) : s{a, b, c, d} {}
+
+	static float_4 load(const float *x) {
+		float_4 v;
+		std::memcpy(v.s, x, sizeof(v.s));
+		return v;
+	}
+
+	void store(float *x) const {
+		std::memcpy(x, s, sizeof(s));
+	}
+
+	float &operator[](int i) {
+		return s[i];
+	}
+
+	const float &operator[](int i) const {
+		return s[i];
+	}
+
+	static float_4 mask() {
+		float_4 v;
+		std::memset(v.s, 0xff, sizeof(v.s));
+		return v;
+	}
+};
+
+template <typename F>
+inline float_4 map(const float_4 &a, const float_4 &b, F f) {
+	float_4 v;
+	for (int i = 0; i < 4; i++) v.s[i] = f(a.s[i], b.s[i]);
+	return v;
+}
+
+template <typename F>
+inline float_4 bits(const float_4 &a, const float_4 &b, F f) {
+	float_4 v;
+	for (int i = 0; i < 4; i++) {
+		uint32_t x, y;
+		std::memcpy(&x, &a.s[i], 4);
+		std::memcpy(&y, &b.s[i], 4);
+		x = f(x, y);
+		std::memcpy(&v.s[i], &x, 4);
+	}
+	return v;
+}
+
+template <typename F>
+inline float_4 compare(const float_4 &a, const float_4 &b, F f) {
+	float_4 v;
+	for (int i = 0; i < 4; i++) {
+		uint32_t x = f(a.s[i], b.s[i]) ? 0xffffffffu : 0u;
+		std::memcpy(&v.s[i], &x, 4);
+	}
+	return v;
+}
+
+inline float_4 operator+(const float_4 &a, const float_4 &b) { return map(a, b, [](float x, float y) { return x + y; }); }
+inline float_4 operator-(const float_4 &a, const float_4 &b) { return map(a, b, [](float x, float y) { return x - y; }); }
+inline float_4 operator*(const float_4 &a, const float_4 &b) { return map(a, b, [](float x, float y) { return x * y; }); }
+inline float_4 operator/(const float_4 &a, const float_4 &b) { return map(a, b, [](float x, float y) { return x / y; }); }
+inline float_4 operator-(const float_4 &a) { return float_4(0.f) - a; }
+inline float_4 &operator+=(float_4 &a, const float_4 &b) { return a = a + b; }
+inline float_4 &operator-=(float_4 &a, const float_4 &b) { return a = a - b; }
+inline float_4 &operator*=(float_4 &a, const float_4 &b) { return a = a * b; }
+
+inline float_4 operator==(const float_4 &a, const float_4 &b) { return compare(a, b, [](float x, float y) { return x == y; }); }
+inline float_4 operator!=(const float_4 &a, const float_4 &b) { return compare(a, b, [](float x, float y) { return x != y; }); }
+inline float_4 operator<(const float_4 &a, const float_4 &b) { return compare(a, b, [](float x, float y) { return x < y; }); }
+inline float_4 operator>(const float_4 &a, const float_4 &b) { return compare(a, b, [](float x, float y) { return x > y; }); }
+inline float_4 operator<=(const float_4 &a, const float_4 &b) { return compare(a, b, [](float x, float y) { return x <= y; }); }
+inline float_4 operator>=(const float_4 &a, const float_4 &b) { return compare(a, b, [](float x, float y) { return x >= y; }); }
+
+inline float_4 operator&(const float_4 &a, const float_4 &b) { return bits(a, b, [](uint32_t x, uint32_t y) { return x & y; }); }
+inline float_4 operator|(const float_4 &a, const float_4 &b) { return bits(a, b, [](uint32_t x, uint32_t y) { return x | y; }); }
+inline float_4 operator^(const float_4 &a, const float_4 &b) { return bits(a, b, [](uint32_t x, uint32_t y) { return x ^ y; }); }
+inline float_4 operator~(const float_4 &a) { return a ^ float_4::mask(); }
+
+inline float_4 ifelse(const float_4 &mask, const float_4 &a, const float_4 &b) {
+	return (mask & a) | (~mask & b);
+}
+
+inline float_4 fabs(const float_4 &a) { return map(a, a, [](float x, float) { return std::fabs(x); }); }
+inline float_4 floor(const float_4 &a) { return map(a, a, [](float x, float) { return std::floor(x); }); }
+inline float_4 round(const float_4 &a) { return map(a, a, [](float x, float) { return std::round(x); }); }
+inline float_4 fmin(const float_4 &a, const float_4 &b) { return map(a, b, [](float x, float y) { return std::fmin(x, y); }); }
+inline float_4 fmax(const float_4 &a, const float_4 &b) { return map(a, b, [](float x, float y) { return std::fmax(x, y); }); }
+
+inline int movemask(const float_4 &a) {
+	int m = 0;
+	for (int i = 0; i < 4; i++) m |= std::signbit(a.s[i]) << i;
+	return m;
+}
+
+}
+
+namespace dsp {
+
+struct SchmittTrigger {
+	bool state = true;
+
+	bool process(float in, float lowThreshold = 0.f, float highThreshold = 1.f) {
+		if (state) {
+			if (in <= lowThreshold) {
+				state = false;
+			}
+		} else if (in >= highThreshold) {
+			state = true;
+			return true;
+		}
+		return false;
+	}
+
+	bool isHigh() {
+		return state;
+	}
+};
+
+}
+
+namespace midi {
+
+struct Message {
+	std::vector<uint8_t> bytes = std::vector<uint8_t>(3);
+	int64_t frame = -1;
+
+	int getSize() const {
+		return bytes.size();
+	}
+	void setSize(int size) {
+		bytes.resize(size);
+	}
+	uint8_t getChannel() const {
+		return bytes[0] & 0xf;
+	}
+	void setChannel(uint8_t channel) {
+		bytes[0] = (bytes[0] & 0xf0) | (channel & 0xf);
+	}
+	uint8_t getStatus() const {
+		return bytes[0] >> 4;
+	}
+	void setStatus(uint8_t status) {
+		bytes[0] = (bytes[0] & 0xf) | (status << 4);
+	}
+	uint8_t getNote() const {
+		return bytes[1];
+	}
+	void setNote(uint8_t note) {
+		bytes[1] = note & 0x7f;
+	}
+	uint8_t getValue() const {
+		return bytes[2];
+	}
+	void setValue(uint8_t value) {
+		bytes[2] = value & 0x7f;
+	}
+};
+
+struct InputQueue {
+	virtual ~InputQueue() {}
+	virtual void onMessage(const Message &message) {}
+};
+
+}
+
+}